@@ -0,0 +1,728 @@
+/*
+ * Throughput and latency benchmark for the dummy char device.
+ *
+ * Each run streams records of a given size through one or more devices,
+ * with a producer and a consumer thread per device, using one of the
+ * following access modes:
+ *  rw     - one write()/read() per record;
+ *  readv  - writev()/readv() of IOV_BATCH records per call;
+ *  mmap   - records copied in/out of the shared ring, no system call;
+ *  splice - vmsplice() to a pipe then splice() to the device, and splice()
+ *           from the device to a pipe then to /dev/null.
+ *
+ * Latency is measured for each producer operation: one record for rw,
+ * mmap and splice, one batch of IOV_BATCH records for readv.
+ *
+ * If one thread of a pair fails, it stops the other one, which could be
+ * blocked in the device or spinning on the ring forever: it raises the
+ * pair abort flag and sends SIGUSR1, without SA_RESTART, until the peer
+ * is done.
+ *
+ * Build with "make bench", run as root.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#include "dummy-char.h"
+
+#define DEV_FMT         "/dev/dummy_char%d"
+#define CPU_FMT         "/sys/class/dummy_char_class/dummy_char%d/cpu"
+#define IOV_BATCH       64
+#define MAX_SIZE        (1 << 20)
+#define MAX_THREADS     256
+
+enum mode { MODE_RW, MODE_READV, MODE_MMAP, MODE_SPLICE, NR_MODES };
+
+static const char * const mode_names[NR_MODES] = {
+    [MODE_RW] = "rw",
+    [MODE_READV] = "readv",
+    [MODE_MMAP] = "mmap",
+    [MODE_SPLICE] = "splice",
+};
+
+/* Shared by the two threads of a pair */
+struct pair_ctl {
+    pthread_mutex_t lock;   /* protects done, keeps the peer tid valid */
+    int abort;
+};
+
+/* One producer/consumer pair, streaming through its own device */
+struct pair {
+    int index;
+    enum mode mode;
+    size_t size;
+    uint64_t records;
+    pthread_barrier_t *start;
+    uint64_t *lat;          /* producer latencies, in ns */
+    uint64_t nr_lat;
+    int error;
+    pthread_t tid;
+    int done;
+    struct pair *peer;
+    struct pair_ctl *ctl;
+};
+
+static uint64_t max_records = 1000000;
+static uint64_t max_bytes = 1ULL << 30;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int open_dev(int index, int flags)
+{
+    char path[64];
+    int fd;
+
+    snprintf(path, sizeof(path), DEV_FMT, index);
+    fd = open(path, flags);
+    if (fd < 0)
+        perror(path);
+    return fd;
+}
+
+static int stopped(struct pair *p)
+{
+    return __atomic_load_n(&p->ctl->abort, __ATOMIC_ACQUIRE);
+}
+
+static void wake_handler(int sig)
+{
+    (void)sig;
+}
+
+/*
+ * Called by a thread once it is done with the device. On failure, stop
+ * the peer, interrupting it until it is done too: a single signal could
+ * land right before it blocks.
+ */
+static void pair_exit(struct pair *p, int ret)
+{
+    pthread_mutex_lock(&p->ctl->lock);
+    p->done = 1;
+    pthread_mutex_unlock(&p->ctl->lock);
+
+    /* Errors after the pair was stopped are only the consequence */
+    if (!ret || stopped(p))
+        return;
+    p->error = ret;
+    __atomic_store_n(&p->ctl->abort, 1, __ATOMIC_RELEASE);
+    for (;;) {
+        pthread_mutex_lock(&p->ctl->lock);
+        if (p->peer->done) {
+            pthread_mutex_unlock(&p->ctl->lock);
+            break;
+        }
+        pthread_kill(p->peer->tid, SIGUSR1);
+        pthread_mutex_unlock(&p->ctl->lock);
+        usleep(1000);
+    }
+}
+
+/* Pin the calling thread to the CPU the device memory is local to */
+static void pin_to_dev(int index)
+{
+    char path[96];
+    cpu_set_t set;
+    FILE *f;
+    int cpu;
+
+    snprintf(path, sizeof(path), CPU_FMT, index);
+    f = fopen(path, "r");
+    if (!f)
+        return;
+    if (fscanf(f, "%d", &cpu) == 1) {
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+    fclose(f);
+}
+
+static int write_full(struct pair *p, int fd, const char *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len) {
+        n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR && !stopped(p))
+                continue;
+            return -errno;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int read_full(struct pair *p, int fd, char *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len) {
+        n = read(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR && !stopped(p))
+                continue;
+            return -errno;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Transfer nr iovecs in full, resuming after short transfers */
+static int rwv_full(struct pair *p, int fd, struct iovec *iov, int nr,
+                    int is_write)
+{
+    ssize_t n;
+
+    while (nr) {
+        n = is_write ? writev(fd, iov, nr) : readv(fd, iov, nr);
+        if (n < 0) {
+            if (errno == EINTR && !stopped(p))
+                continue;
+            return -errno;
+        }
+        while (nr && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            nr--;
+        }
+        if (nr) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+static int splice_full(struct pair *p, int in, int out, size_t len)
+{
+    ssize_t n;
+
+    while (len) {
+        n = splice(in, NULL, out, NULL, len, SPLICE_F_MOVE);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR && !stopped(p))
+                continue;
+            return n ? -errno : -EIO;
+        }
+        len -= n;
+    }
+    return 0;
+}
+
+struct ring_map {
+    struct dummy_ring_ctrl *ctrl;
+    char *data;
+    size_t map_len;
+    uint32_t size;
+};
+
+static int map_ring(int fd, struct ring_map *map)
+{
+    struct dummy_ring_info info;
+    void *addr;
+
+    if (ioctl(fd, DUMMY_IOC_GET_INFO, &info) < 0)
+        return -errno;
+
+    map->map_len = info.data_offset + info.size;
+    addr = mmap(NULL, map->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED)
+        return -errno;
+
+    map->ctrl = addr;
+    map->data = (char *)addr + info.data_offset;
+    map->size = info.size;
+    return 0;
+}
+
+/*
+ * Userspace side of the ring protocol described in dummy-char.h. Spin
+ * while the ring is full (or empty), yielding so that the peer gets to
+ * run even when both threads share a CPU, until the pair is stopped.
+ */
+static int ring_put(struct pair *p, struct ring_map *map, const char *buf,
+                    size_t len)
+{
+    uint32_t head, tail, space, off, n, chunk;
+
+    head = map->ctrl->head;
+    while (len) {
+        tail = __atomic_load_n(&map->ctrl->tail, __ATOMIC_ACQUIRE);
+        space = map->size - (head - tail);
+        if (!space) {
+            if (stopped(p))
+                return -ECANCELED;
+            sched_yield();
+            continue;
+        }
+        n = len < space ? len : space;
+        off = head & (map->size - 1);
+        chunk = n < map->size - off ? n : map->size - off;
+        memcpy(map->data + off, buf, chunk);
+        memcpy(map->data, buf + chunk, n - chunk);
+        head += n;
+        __atomic_store_n(&map->ctrl->head, head, __ATOMIC_RELEASE);
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int ring_get(struct pair *p, struct ring_map *map, char *buf,
+                    size_t len)
+{
+    uint32_t head, tail, avail, off, n, chunk;
+
+    tail = map->ctrl->tail;
+    while (len) {
+        head = __atomic_load_n(&map->ctrl->head, __ATOMIC_ACQUIRE);
+        avail = head - tail;
+        if (!avail) {
+            if (stopped(p))
+                return -ECANCELED;
+            sched_yield();
+            continue;
+        }
+        n = len < avail ? len : avail;
+        off = tail & (map->size - 1);
+        chunk = n < map->size - off ? n : map->size - off;
+        memcpy(buf, map->data + off, chunk);
+        memcpy(buf + chunk, map->data, n - chunk);
+        tail += n;
+        __atomic_store_n(&map->ctrl->tail, tail, __ATOMIC_RELEASE);
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static void *producer(void *arg)
+{
+    struct pair *p = arg;
+    struct iovec iov[IOV_BATCH];
+    struct ring_map map;
+    int fd, pipefd[2] = { -1, -1 };
+    uint64_t i, t0, nr;
+    char *buf;
+    int j, ret = 0;
+
+    pin_to_dev(p->index);
+    buf = malloc(p->size * IOV_BATCH);
+    fd = open_dev(p->index, O_WRONLY);
+    if (!buf || fd < 0) {
+        ret = fd < 0 ? -ENODEV : -ENOMEM;
+        pthread_barrier_wait(p->start);
+        goto out;
+    }
+    memset(buf, 0x5a, p->size * IOV_BATCH);
+
+    if (p->mode == MODE_MMAP)
+        ret = map_ring(fd, &map);
+    if (p->mode == MODE_SPLICE) {
+        ret = pipe(pipefd) ? -errno : 0;
+        if (!ret)
+            fcntl(pipefd[1], F_SETPIPE_SZ, MAX_SIZE);
+    }
+
+    pthread_barrier_wait(p->start);
+    if (ret)
+        goto out;
+
+    for (i = 0; i < p->records && !ret; i += nr) {
+        nr = 1;
+        t0 = now_ns();
+
+        switch (p->mode) {
+        case MODE_RW:
+            ret = write_full(p, fd, buf, p->size);
+            break;
+
+        case MODE_READV:
+            nr = p->records - i < IOV_BATCH ? p->records - i : IOV_BATCH;
+            for (j = 0; j < (int)nr; j++) {
+                iov[j].iov_base = buf + j * p->size;
+                iov[j].iov_len = p->size;
+            }
+            ret = rwv_full(p, fd, iov, nr, 1);
+            break;
+
+        case MODE_MMAP:
+            ret = ring_put(p, &map, buf, p->size);
+            break;
+
+        case MODE_SPLICE: {
+            size_t left = p->size;
+            struct iovec v;
+            ssize_t n;
+
+            while (left && !ret) {
+                v.iov_base = buf + p->size - left;
+                v.iov_len = left;
+                n = vmsplice(pipefd[1], &v, 1, 0);
+                if (n < 0) {
+                    if (errno == EINTR && !stopped(p))
+                        continue;
+                    ret = -errno;
+                    break;
+                }
+                ret = splice_full(p, pipefd[0], fd, n);
+                left -= n;
+            }
+            break;
+        }
+
+        default:
+            break;
+        }
+
+        p->lat[p->nr_lat++] = now_ns() - t0;
+    }
+
+    if (p->mode == MODE_MMAP)
+        munmap(map.ctrl, map.map_len);
+
+out:
+    pair_exit(p, ret);
+    if (pipefd[0] >= 0) {
+        close(pipefd[0]);
+        close(pipefd[1]);
+    }
+    if (fd >= 0)
+        close(fd);
+    free(buf);
+    return NULL;
+}
+
+static void *consumer(void *arg)
+{
+    struct pair *p = arg;
+    struct iovec iov[IOV_BATCH];
+    struct ring_map map;
+    int fd, nullfd = -1, pipefd[2] = { -1, -1 };
+    uint64_t i, nr;
+    char *buf;
+    int j, ret = 0;
+
+    buf = malloc(p->size * IOV_BATCH);
+    fd = open_dev(p->index, O_RDONLY);
+    if (!buf || fd < 0) {
+        ret = fd < 0 ? -ENODEV : -ENOMEM;
+        pthread_barrier_wait(p->start);
+        goto out;
+    }
+
+    if (p->mode == MODE_MMAP)
+        ret = map_ring(fd, &map);
+    if (p->mode == MODE_SPLICE) {
+        nullfd = open("/dev/null", O_WRONLY);
+        ret = (nullfd < 0 || pipe(pipefd)) ? -errno : 0;
+        if (!ret)
+            fcntl(pipefd[1], F_SETPIPE_SZ, MAX_SIZE);
+    }
+
+    pthread_barrier_wait(p->start);
+    if (ret)
+        goto out;
+
+    for (i = 0; i < p->records && !ret; i += nr) {
+        nr = 1;
+
+        switch (p->mode) {
+        case MODE_RW:
+            ret = read_full(p, fd, buf, p->size);
+            break;
+
+        case MODE_READV:
+            nr = p->records - i < IOV_BATCH ? p->records - i : IOV_BATCH;
+            for (j = 0; j < (int)nr; j++) {
+                iov[j].iov_base = buf + j * p->size;
+                iov[j].iov_len = p->size;
+            }
+            ret = rwv_full(p, fd, iov, nr, 0);
+            break;
+
+        case MODE_MMAP:
+            ret = ring_get(p, &map, buf, p->size);
+            break;
+
+        case MODE_SPLICE: {
+            size_t left = p->size;
+            ssize_t n;
+
+            while (left && !ret) {
+                n = splice(fd, NULL, pipefd[1], NULL, left, SPLICE_F_MOVE);
+                if (n <= 0) {
+                    if (n < 0 && errno == EINTR && !stopped(p))
+                        continue;
+                    ret = n ? -errno : -EIO;
+                    break;
+                }
+                ret = splice_full(p, pipefd[0], nullfd, n);
+                left -= n;
+            }
+            break;
+        }
+
+        default:
+            break;
+        }
+    }
+
+    if (p->mode == MODE_MMAP)
+        munmap(map.ctrl, map.map_len);
+
+out:
+    pair_exit(p, ret);
+    if (pipefd[0] >= 0) {
+        close(pipefd[0]);
+        close(pipefd[1]);
+    }
+    if (nullfd >= 0)
+        close(nullfd);
+    if (fd >= 0)
+        close(fd);
+    free(buf);
+    return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static uint64_t percentile(uint64_t *lat, uint64_t nr, double pct)
+{
+    uint64_t i = (uint64_t)(nr * pct / 100.0);
+
+    return nr ? lat[i < nr ? i : nr - 1] : 0;
+}
+
+static int run(enum mode mode, size_t size, int threads, int csv)
+{
+    struct pair prod[MAX_THREADS], cons[MAX_THREADS];
+    struct pair_ctl ctl[MAX_THREADS];
+    pthread_barrier_t start;
+    uint64_t records, total_lat = 0, *lat, t0, elapsed;
+    double secs, bytes;
+    int i, ret = 0;
+
+    records = max_bytes / size;
+    if (records > max_records)
+        records = max_records;
+    if (!records)
+        records = 1;
+
+    /* Allocate everything up front: no thread is running yet */
+    for (i = 0; i < threads; i++) {
+        memset(&prod[i], 0, sizeof(prod[i]));
+        prod[i].lat = calloc(records, sizeof(uint64_t));
+        if (!prod[i].lat) {
+            fprintf(stderr, "%s/%zu: out of memory\n", mode_names[mode], size);
+            while (i--)
+                free(prod[i].lat);
+            return -1;
+        }
+    }
+
+    /*
+     * The tids are only used by pair_exit(), after the start barrier, by
+     * which time they are all set.
+     */
+    pthread_barrier_init(&start, NULL, 2 * threads + 1);
+    for (i = 0; i < threads; i++) {
+        pthread_mutex_init(&ctl[i].lock, NULL);
+        ctl[i].abort = 0;
+        prod[i].index = i;
+        prod[i].mode = mode;
+        prod[i].size = size;
+        prod[i].records = records;
+        prod[i].start = &start;
+        prod[i].ctl = &ctl[i];
+        cons[i] = prod[i];
+        cons[i].lat = NULL;
+        prod[i].peer = &cons[i];
+        cons[i].peer = &prod[i];
+        pthread_create(&cons[i].tid, NULL, consumer, &cons[i]);
+        pthread_create(&prod[i].tid, NULL, producer, &prod[i]);
+    }
+
+    pthread_barrier_wait(&start);
+    t0 = now_ns();
+    for (i = 0; i < threads; i++) {
+        pthread_join(prod[i].tid, NULL);
+        pthread_join(cons[i].tid, NULL);
+        pthread_mutex_destroy(&ctl[i].lock);
+    }
+    elapsed = now_ns() - t0;
+    pthread_barrier_destroy(&start);
+
+    lat = malloc(threads * records * sizeof(uint64_t));
+    if (!lat) {
+        fprintf(stderr, "%s/%zu: out of memory\n", mode_names[mode], size);
+        ret = -1;
+    }
+    for (i = 0; i < threads; i++) {
+        if (prod[i].error || cons[i].error) {
+            fprintf(stderr, "%s/%zu: pair %d failed: %s\n", mode_names[mode],
+                    size, i, strerror(-(prod[i].error ?: cons[i].error)));
+            ret = -1;
+        }
+        if (lat)
+            memcpy(lat + total_lat, prod[i].lat,
+                   prod[i].nr_lat * sizeof(uint64_t));
+        total_lat += prod[i].nr_lat;
+        free(prod[i].lat);
+    }
+
+    if (!ret) {
+        qsort(lat, total_lat, sizeof(uint64_t), cmp_u64);
+        secs = elapsed / 1e9;
+        bytes = (double)threads * records * size;
+        printf(csv ? "%s,%zu,%d,%.0f,%.6f,%.2f,%.0f,%llu,%llu,%llu\n" :
+                     "%-7s %8zu %4d %14.0f %10.6f %10.2f %12.0f %10llu %10llu %10llu\n",
+               mode_names[mode], size, threads, bytes, secs,
+               bytes / secs / 1e6, threads * records / secs,
+               (unsigned long long)percentile(lat, total_lat, 50),
+               (unsigned long long)percentile(lat, total_lat, 99),
+               (unsigned long long)percentile(lat, total_lat, 99.9));
+        fflush(stdout);
+    }
+
+    free(lat);
+    return ret;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+        "usage: %s [-m modes] [-s sizes] [-t threads] [-n records] [-b bytes] [-c]\n"
+        "  -m  comma separated access modes among rw,readv,mmap,splice (default: all)\n"
+        "  -s  comma separated record sizes in bytes, 1 to %d (default: 1,4,...,1M)\n"
+        "  -t  comma separated thread pair counts, using dummy_char0..N-1 (default: 1)\n"
+        "  -n  max records per run and per pair (default: %llu)\n"
+        "  -b  max bytes per run and per pair (default: %llu)\n"
+        "  -c  CSV output\n",
+        prog, MAX_SIZE, (unsigned long long)max_records,
+        (unsigned long long)max_bytes);
+    exit(1);
+}
+
+/* Parse a comma separated list of numbers, with k/M suffixes */
+static int parse_list(char *arg, long *vals, int max)
+{
+    char *tok, *end;
+    int nr = 0;
+
+    for (tok = strtok(arg, ","); tok && nr < max; tok = strtok(NULL, ",")) {
+        vals[nr] = strtol(tok, &end, 0);
+        if (*end == 'k' || *end == 'K')
+            vals[nr] <<= 10;
+        else if (*end == 'm' || *end == 'M')
+            vals[nr] <<= 20;
+        nr++;
+    }
+    return nr;
+}
+
+int main(int argc, char **argv)
+{
+    long sizes[32], threads[32] = { 1 };
+    int nr_sizes = 0, nr_threads = 1, csv = 0, modes = 0;
+    int opt, m, s, t, ret = 0;
+    struct sigaction sa;
+    char *tok;
+
+    while ((opt = getopt(argc, argv, "m:s:t:n:b:ch")) != -1) {
+        switch (opt) {
+        case 'm':
+            for (tok = strtok(optarg, ","); tok; tok = strtok(NULL, ",")) {
+                for (m = 0; m < NR_MODES; m++)
+                    if (!strcmp(tok, mode_names[m]))
+                        break;
+                if (m == NR_MODES)
+                    usage(argv[0]);
+                modes |= 1 << m;
+            }
+            break;
+        case 's':
+            nr_sizes = parse_list(optarg, sizes, 32);
+            break;
+        case 't':
+            nr_threads = parse_list(optarg, threads, 32);
+            break;
+        case 'n':
+            max_records = strtoull(optarg, NULL, 0);
+            break;
+        case 'b':
+            max_bytes = strtoull(optarg, NULL, 0);
+            break;
+        case 'c':
+            csv = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (!modes)
+        modes = (1 << NR_MODES) - 1;
+    if (!nr_sizes)
+        for (sizes[0] = 1; sizes[nr_sizes] <= MAX_SIZE; nr_sizes++)
+            sizes[nr_sizes + 1] = sizes[nr_sizes] * 4;
+
+    for (s = 0; s < nr_sizes; s++)
+        if (sizes[s] < 1 || sizes[s] > MAX_SIZE)
+            usage(argv[0]);
+    for (t = 0; t < nr_threads; t++)
+        if (threads[t] < 1 || threads[t] > MAX_THREADS)
+            usage(argv[0]);
+    if (!max_records || !max_bytes)
+        usage(argv[0]);
+
+    /* No SA_RESTART: SIGUSR1 makes blocked calls fail with EINTR */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = wake_handler;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR1, &sa, NULL);
+
+    printf(csv ? "mode,record_size,threads,bytes,seconds,MBps,ops_per_sec,p50_ns,p99_ns,p999_ns\n" :
+                 "%-7s %8s %4s %14s %10s %10s %12s %10s %10s %10s\n",
+           "mode", "size", "thr", "bytes", "seconds", "MB/s", "ops/s",
+           "p50(ns)", "p99(ns)", "p999(ns)");
+
+    for (m = 0; m < NR_MODES; m++) {
+        if (!(modes & (1 << m)))
+            continue;
+        for (t = 0; t < nr_threads; t++)
+            for (s = 0; s < nr_sizes; s++)
+                if (run(m, sizes[s], threads[t], csv))
+                    ret = 1;
+    }
+
+    return ret;
+}
@@ -0,0 +1,68 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Tracepoints of the dummy char device. Enable them with:
+ *   echo 1 > /sys/kernel/tracing/events/dummy_char/enable
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM dummy_char
+
+#if !defined(_DUMMY_CHAR_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _DUMMY_CHAR_TRACE_H
+
+#include <linux/tracepoint.h>
+
+#define DUMMY_OP_OPEN       0
+#define DUMMY_OP_RELEASE    1
+#define DUMMY_OP_READ       2
+#define DUMMY_OP_WRITE      3
+
+/*
+ * One event per file operation:
+ *  size - bytes asked for by the caller;
+ *  offset - ring index (tail for reads, head for writes) the operation
+ *    started at;
+ *  latency - time spent in the operation, sleeping included;
+ *  ret - what the operation returned.
+ */
+TRACE_EVENT(dummy_char_op,
+
+    TP_PROTO(unsigned int minor, unsigned int op, size_t size, u64 offset,
+             u64 latency, ssize_t ret),
+
+    TP_ARGS(minor, op, size, offset, latency, ret),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(unsigned int, op)
+        __field(size_t, size)
+        __field(u64, offset)
+        __field(u64, latency)
+        __field(ssize_t, ret)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->op = op;
+        __entry->size = size;
+        __entry->offset = offset;
+        __entry->latency = latency;
+        __entry->ret = ret;
+    ),
+
+    TP_printk("minor=%u op=%s size=%zu offset=%llu latency=%lluns ret=%zd",
+              __entry->minor,
+              __print_symbolic(__entry->op,
+                               { DUMMY_OP_OPEN, "open" },
+                               { DUMMY_OP_RELEASE, "release" },
+                               { DUMMY_OP_READ, "read" },
+                               { DUMMY_OP_WRITE, "write" }),
+              __entry->size, __entry->offset, __entry->latency, __entry->ret)
+);
+
+#endif /* _DUMMY_CHAR_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE dummy-char-trace
+#include <trace/define_trace.h>
@@ -4,57 +4,689 @@
 #include <linux/version.h>
 #include <linux/device.h>
 #include <linux/cdev.h>
+#include <linux/cpumask.h>
+#include <linux/debugfs.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/poll.h>
+#include <linux/sched/signal.h>
+#include <linux/uaccess.h>
+#include <linux/uio.h>
+#include <linux/slab.h>
+#include <linux/seq_file.h>
+#include <linux/splice.h>
+#include <linux/vmalloc.h>
+#include <linux/wait.h>
+
+#include "dummy-char.h"
+
+#define CREATE_TRACE_POINTS
+#include "dummy-char-trace.h"
+
+#define DUMMY_RING_MIN_SIZE     PAGE_SIZE
+#define DUMMY_RING_MAX_SIZE     (1U << 30)
+
+static unsigned int ring_size = 1 << 20;
+module_param(ring_size, uint, 0444);
+MODULE_PARM_DESC(ring_size,
+                 "ring buffer size in bytes, rounded up to a power of two (default 1MiB)");
+
+static unsigned int ndevices;
+module_param(ndevices, uint, 0444);
+MODULE_PARM_DESC(ndevices, "number of devices (default: one per online CPU)");
+
+/*
+ * Single-producer/single-consumer ring buffer.
+ *  ctrl - control page holding the free running producer (head) and
+ *    consumer (tail) indexes, see dummy-char.h;
+ *  data - the data ring, right after the control page;
+ *  pages - the control page followed by the data pages, vmap()ed
+ *    contiguously for the kernel and handed as is to mmap();
+ *  high/low - wakeup watermarks, see struct dummy_ring_watermarks;
+ *  read_batch - bytes the reader blocked in read() waits for, 0 if none;
+ *  fasync - SIGIO subscribers, notified along with the wait queues;
+ *  write_lock/read_lock - serialize writers against writers and readers
+ *    against readers. The reader and the writer never share a lock: they
+ *    only talk through head and tail.
+ *
+ * Both sides may live in userspace, through the mapping. The indexes are
+ * then moved without the driver knowing, so they are never trusted beyond
+ * keeping the offsets within the ring; DUMMY_IOC_WAKE lets userspace wake
+ * up a peer blocked in read() or write().
+ */
+struct dummy_ring {
+    struct dummy_ring_ctrl *ctrl;
+    char *data;
+    unsigned int size;
+    struct page **pages;
+    unsigned int nr_pages;
+    wait_queue_head_t read_wq;
+    wait_queue_head_t write_wq;
+    unsigned int high;
+    unsigned int low;
+    unsigned int read_batch;
+    struct fasync_struct *fasync;
+
+    struct mutex write_lock ____cacheline_aligned_in_smp;
+    struct mutex read_lock ____cacheline_aligned_in_smp;
+};
+
+/*
+ * Operation counters. They are per-CPU, so that the data path never
+ * writes to a shared cache line, and only summed up when read from
+ * debugfs.
+ */
+struct dummy_stats {
+    u64 opens;
+    u64 reads;
+    u64 writes;
+    u64 read_bytes;
+    u64 written_bytes;
+};
+
+/*
+ * One instance per minor. Each one is bound to a CPU and allocated, ring
+ * included, on that CPU's memory node: threads pinned to different CPUs
+ * and using different minors never share any memory.
+ */
+struct dummy_dev {
+    struct dummy_ring ring;
+    struct cdev cdev;
+    struct device *device;
+    struct dummy_stats __percpu *stats;
+    unsigned int cpu;
+};
 
 static unsigned int major; /* major number for device */
 static struct class *dummy_class;
-static struct cdev dummy_cdev;
+static struct dummy_dev **dummy_devs;
+static struct dentry *dummy_debugfs;
+
+static inline struct dummy_dev *ring_to_dev(struct dummy_ring *ring)
+{
+    return container_of(ring, struct dummy_dev, ring);
+}
+
+/* Only pay for timestamps when somebody listens to the tracepoint */
+static inline u64 dummy_trace_start(void)
+{
+    return trace_dummy_char_op_enabled() ? ktime_get_ns() : 0;
+}
+
+static inline void dummy_trace(struct dummy_dev *dev, unsigned int op,
+                               size_t size, u64 offset, u64 start, ssize_t ret)
+{
+    trace_dummy_char_op(MINOR(dev->cdev.dev), op, size, offset,
+                        start ? ktime_get_ns() - start : 0, ret);
+}
 
+/* Bytes available to the reader. Only the reader may call this. */
+static inline unsigned int dummy_ring_count(struct dummy_ring *ring)
+{
+    /* Pairs with smp_store_release() of head in dummy_write_iter() */
+    unsigned int used = smp_load_acquire(&ring->ctrl->head) -
+                        READ_ONCE(ring->ctrl->tail);
+
+    return min(used, ring->size);
+}
+
+/* Room available to the writer. Only the writer may call this. */
+static inline unsigned int dummy_ring_space(struct dummy_ring *ring)
+{
+    /* Pairs with smp_store_release() of tail in dummy_read_iter() */
+    unsigned int used = READ_ONCE(ring->ctrl->head) -
+                        smp_load_acquire(&ring->ctrl->tail);
+
+    return ring->size - min(used, ring->size);
+}
+
+/* Fill level of the ring, for wakeup decisions only */
+static inline unsigned int dummy_ring_used(struct dummy_ring *ring)
+{
+    unsigned int used = READ_ONCE(ring->ctrl->head) -
+                        READ_ONCE(ring->ctrl->tail);
+
+    return min(used, ring->size);
+}
+
+static void dummy_ring_wake_readers(struct dummy_ring *ring)
+{
+    wake_up_interruptible_poll(&ring->read_wq, EPOLLIN | EPOLLRDNORM);
+    kill_fasync(&ring->fasync, SIGIO, POLL_IN);
+}
+
+static void dummy_ring_wake_writers(struct dummy_ring *ring)
+{
+    wake_up_interruptible_poll(&ring->write_wq, EPOLLOUT | EPOLLWRNORM);
+    kill_fasync(&ring->fasync, SIGIO, POLL_OUT);
+}
+
+/*
+ * Called by the writer once head moved forward by n bytes. Readers are
+ * only woken up if this very write made the fill level cross the high
+ * watermark, or the smaller batch a blocked read() waits for: the latter
+ * only wakes that reader up, pollers and SIGIO keep following high. The
+ * fill level is sampled after head is published, so that a reader going
+ * to sleep concurrently either sees the new head or gets its wakeup.
+ */
+static void dummy_ring_produced(struct dummy_ring *ring, unsigned int n)
+{
+    unsigned int high = READ_ONCE(ring->high);
+    unsigned int used, batch;
+
+    /* Order the head update against the tail and read_batch reads */
+    smp_mb();
+    used = dummy_ring_used(ring);
+    batch = READ_ONCE(ring->read_batch);
+    /* If used < n, the reader already ate part of it: it is awake */
+    if (used >= high && used - n < high)
+        dummy_ring_wake_readers(ring);
+    else if (batch && used >= batch && used - n < batch)
+        wake_up_interruptible(&ring->read_wq);
+}
+
+/* Same as above, for the reader crossing the low watermark downwards */
+static void dummy_ring_consumed(struct dummy_ring *ring, unsigned int n)
+{
+    unsigned int low = READ_ONCE(ring->low);
+    unsigned int used;
+
+    /* Order the tail update against the head read */
+    smp_mb();
+    used = dummy_ring_used(ring);
+    if (used <= low && used + n > low)
+        dummy_ring_wake_writers(ring);
+}
+
+/*
+ * O_NONBLOCK files and IOCB_NOWAIT requests (io_uring's inline attempt)
+ * must never sleep, not even on the per-side mutex.
+ */
+static inline bool dummy_nonblock(struct kiocb *iocb)
+{
+    return (iocb->ki_filp->f_flags & O_NONBLOCK) ||
+           (iocb->ki_flags & IOCB_NOWAIT);
+}
+
+/*
+ * Wait condition of a blocking reader of count bytes: a whole batch, or
+ * what it asked for if less. Recomputed on each wakeup, since the high
+ * watermark may have changed meanwhile, and published for
+ * dummy_ring_produced().
+ */
+static bool dummy_read_ready(struct dummy_ring *ring, size_t count,
+                             unsigned int *avail)
+{
+    unsigned int batch = min_t(size_t, READ_ONCE(ring->high), count);
+
+    WRITE_ONCE(ring->read_batch, batch);
+    /* Order the read_batch update against the head read */
+    smp_mb();
+    *avail = dummy_ring_count(ring);
+    return *avail >= batch;
+}
+
+static int dummy_ring_lock(struct mutex *lock, bool nonblock)
+{
+    if (nonblock)
+        return mutex_trylock(lock) ? 0 : -EAGAIN;
+
+    return mutex_lock_interruptible(lock);
+}
 
 int dummy_open(struct inode * inode, struct file * filp)
 {
-    pr_info("Someone tried to open me\n");
+    struct dummy_dev *dev = container_of(inode->i_cdev, struct dummy_dev, cdev);
+
+    this_cpu_inc(dev->stats->opens);
+    dummy_trace(dev, DUMMY_OP_OPEN, 0, 0, 0, 0);
+    filp->private_data = &dev->ring;
+    /* The ring is a stream: there is no file position to maintain */
+    stream_open(inode, filp);
+    /* Let io_uring complete requests inline, see dummy_nonblock() */
+    filp->f_mode |= FMODE_NOWAIT;
     return 0;
 }
 
+static int dummy_fasync(int fd, struct file *filp, int on)
+{
+    struct dummy_ring *ring = filp->private_data;
+
+    return fasync_helper(fd, filp, on, &ring->fasync);
+}
+
 int dummy_release(struct inode * inode, struct file * filp)
 {
-    pr_info("Someone closed me\n");
+    struct dummy_ring *ring = filp->private_data;
+
+    dummy_trace(ring_to_dev(ring), DUMMY_OP_RELEASE, 0, 0, 0, 0);
+    dummy_fasync(-1, filp, 0);
     return 0;
 }
 
-ssize_t dummy_read (struct file *filp, char __user * buf, size_t count,
-                                loff_t * offset)
+/*
+ * Both data paths work on iov_iters, so readv()/writev() and io_uring move
+ * a whole scatter list per call and per lock round trip.
+ */
+static ssize_t dummy_read_iter(struct kiocb *iocb, struct iov_iter *to)
 {
-    pr_info("Nothing to read\n");
-    return 0;
+    struct dummy_ring *ring = iocb->ki_filp->private_data;
+    struct dummy_dev *dev = ring_to_dev(ring);
+    bool nonblock = dummy_nonblock(iocb);
+    size_t count = iov_iter_count(to);
+    unsigned int avail, tail, off, chunk;
+    u64 start = dummy_trace_start();
+    size_t copied;
+    ssize_t ret;
+
+    if (!count)
+        return 0;
+
+    ret = dummy_ring_lock(&ring->read_lock, nonblock);
+    if (ret)
+        return ret;
+
+    /* Only moved by us, the reader, from now on */
+    tail = READ_ONCE(ring->ctrl->tail);
+
+    /*
+     * A non blocking reader takes whatever is there, while a blocking one
+     * waits for a whole batch (or for what it asked for, if less): that is
+     * also the only point where the writer wakes it up.
+     */
+    avail = dummy_ring_count(ring);
+    if (!avail && nonblock) {
+        ret = -EAGAIN;
+        goto out;
+    }
+    if (!nonblock) {
+        ret = wait_event_interruptible(ring->read_wq,
+                                       dummy_read_ready(ring, count, &avail));
+        WRITE_ONCE(ring->read_batch, 0);
+        if (ret)
+            goto out;
+    }
+
+    avail = min_t(size_t, avail, count);
+    off = tail & (ring->size - 1);
+    chunk = min(avail, ring->size - off);
+
+    copied = copy_to_iter(ring->data + off, chunk, to);
+    if (copied == chunk && avail > chunk)
+        copied += copy_to_iter(ring->data, avail - chunk, to);
+    if (!copied) {
+        ret = -EFAULT;
+        goto out;
+    }
+
+    /* Data must be consumed before the room is handed back to the writer */
+    smp_store_release(&ring->ctrl->tail, tail + copied);
+    dummy_ring_consumed(ring, copied);
+
+    this_cpu_inc(dev->stats->reads);
+    this_cpu_add(dev->stats->read_bytes, copied);
+    ret = copied;
+out:
+    mutex_unlock(&ring->read_lock);
+    dummy_trace(dev, DUMMY_OP_READ, count, tail, start, ret);
+    return ret;
+}
+
+
+static ssize_t dummy_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct dummy_ring *ring = iocb->ki_filp->private_data;
+    struct dummy_dev *dev = ring_to_dev(ring);
+    bool nonblock = dummy_nonblock(iocb);
+    size_t count = iov_iter_count(from);
+    unsigned int space, head, first, off, chunk;
+    u64 start = dummy_trace_start();
+    size_t copied, written = 0;
+    ssize_t ret;
+
+    if (!count)
+        return 0;
+
+    ret = dummy_ring_lock(&ring->write_lock, nonblock);
+    if (ret)
+        return ret;
+
+    first = READ_ONCE(ring->ctrl->head);
+
+    /* Like a pipe, a blocking write only returns once everything is in */
+    while (written < count) {
+        space = dummy_ring_space(ring);
+        if (!space) {
+            if (nonblock) {
+                ret = -EAGAIN;
+                break;
+            }
+            /* Woken up once the fill level dropped to the low watermark */
+            ret = wait_event_interruptible(ring->write_wq,
+                    ring->size - dummy_ring_space(ring) <= READ_ONCE(ring->low));
+            if (ret)
+                break;
+            continue;
+        }
+
+        space = min_t(size_t, space, count - written);
+        head = READ_ONCE(ring->ctrl->head);
+        off = head & (ring->size - 1);
+        chunk = min(space, ring->size - off);
+
+        copied = copy_from_iter(ring->data + off, chunk, from);
+        if (copied == chunk && space > chunk)
+            copied += copy_from_iter(ring->data, space - chunk, from);
+
+        /* Data must be visible before the reader can see the new head */
+        if (copied) {
+            smp_store_release(&ring->ctrl->head, head + copied);
+            dummy_ring_produced(ring, copied);
+            written += copied;
+        }
+
+        if (copied != space) {
+            ret = -EFAULT;
+            break;
+        }
+    }
+
+    mutex_unlock(&ring->write_lock);
+
+    if (written) {
+        this_cpu_inc(dev->stats->writes);
+        this_cpu_add(dev->stats->written_bytes, written);
+        ret = written;
+    }
+    dummy_trace(dev, DUMMY_OP_WRITE, count, first, start, ret);
+    return ret;
 }
 
+/*
+ * Map the control page and the data ring, in this order, as described by
+ * DUMMY_IOC_GET_INFO. The mapping must be shared for the indexes to be
+ * seen by the driver.
+ */
+static int dummy_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    struct dummy_ring *ring = filp->private_data;
+
+    if (!(vma->vm_flags & VM_SHARED))
+        return -EINVAL;
+
+    vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+    return vm_map_pages(vma, ring->pages, ring->nr_pages);
+}
+
+static long dummy_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    struct dummy_ring *ring = filp->private_data;
+    struct dummy_ring_watermarks wm;
+    struct dummy_ring_info info;
+
+    switch (cmd) {
+    case DUMMY_IOC_GET_INFO:
+        info.size = ring->size;
+        info.data_offset = PAGE_SIZE;
+        if (copy_to_user((void __user *)arg, &info, sizeof(info)))
+            return -EFAULT;
+        return 0;
+
+    case DUMMY_IOC_WAKE:
+        dummy_ring_wake_readers(ring);
+        dummy_ring_wake_writers(ring);
+        return 0;
+
+    case DUMMY_IOC_SET_WATERMARKS:
+        if (copy_from_user(&wm, (void __user *)arg, sizeof(wm)))
+            return -EFAULT;
+        if (!wm.high || wm.high > ring->size || wm.low >= ring->size)
+            return -EINVAL;
+        WRITE_ONCE(ring->high, wm.high);
+        WRITE_ONCE(ring->low, wm.low);
+        /* Waiters may already be satisfied by the new thresholds */
+        dummy_ring_wake_readers(ring);
+        dummy_ring_wake_writers(ring);
+        return 0;
+
+    case DUMMY_IOC_GET_WATERMARKS:
+        wm.high = READ_ONCE(ring->high);
+        wm.low = READ_ONCE(ring->low);
+        if (copy_to_user((void __user *)arg, &wm, sizeof(wm)))
+            return -EFAULT;
+        return 0;
+
+    default:
+        return -ENOTTY;
+    }
+}
 
-ssize_t dummy_write(struct file * filp, const char __user * buf, size_t count,
-                                loff_t * offset)
+/*
+ * Readable once a batch (the high watermark) is available, writable once
+ * the fill level is at or below the low watermark. Since wakeups only
+ * happen when a watermark is crossed, this is well suited to EPOLLET.
+ */
+static __poll_t dummy_poll(struct file *filp, poll_table *wait)
 {
-    pr_info("Can't accept any data\n");
-    return count;
+    struct dummy_ring *ring = filp->private_data;
+    __poll_t mask = 0;
+    unsigned int used;
+
+    poll_wait(filp, &ring->read_wq, wait);
+    poll_wait(filp, &ring->write_wq, wait);
+
+    used = dummy_ring_used(ring);
+    if (used >= READ_ONCE(ring->high))
+        mask |= EPOLLIN | EPOLLRDNORM;
+    if (used <= READ_ONCE(ring->low))
+        mask |= EPOLLOUT | EPOLLWRNORM;
+
+    return mask;
 }
 
+/*
+ * splice(2) and sendfile(2) go through the iov_iter data path: the ring
+ * is filled from, or drained into, the pipe buffers with a single copy
+ * and no trip to userspace. Ring pages are never handed to the pipe by
+ * reference, as they are recycled as soon as the data is consumed while a
+ * pipe buffer may be held for much longer.
+ */
 struct file_operations dummy_fops = {
     open:       dummy_open,
     release:    dummy_release,
-    read:       dummy_read,
-    write:      dummy_write,
+    read_iter:  dummy_read_iter,
+    write_iter: dummy_write_iter,
+    splice_read:    generic_file_splice_read,
+    splice_write:   iter_file_splice_write,
+    mmap:       dummy_mmap,
+    poll:       dummy_poll,
+    fasync:     dummy_fasync,
+    unlocked_ioctl: dummy_ioctl,
+    compat_ioctl:   compat_ptr_ioctl,
+    llseek:     no_llseek,
 };
 
+static int dummy_ring_init(struct dummy_ring *ring, unsigned int size, int node)
+{
+    unsigned int i;
+    void *vaddr;
+
+    size = clamp_t(unsigned int, size, DUMMY_RING_MIN_SIZE, DUMMY_RING_MAX_SIZE);
+    ring->size = roundup_pow_of_two(size);
+
+    /* One control page, then the data ring */
+    ring->nr_pages = 1 + (ring->size >> PAGE_SHIFT);
+    ring->pages = kvzalloc_node(array_size(ring->nr_pages, sizeof(*ring->pages)),
+                                GFP_KERNEL, node);
+    if (!ring->pages)
+        return -ENOMEM;
+
+    for (i = 0; i < ring->nr_pages; i++) {
+        ring->pages[i] = alloc_pages_node(node, GFP_KERNEL | __GFP_ZERO, 0);
+        if (!ring->pages[i])
+            goto err_free_pages;
+    }
+
+    /* Map the pages contiguously, so the data path deals with plain offsets */
+    vaddr = vmap(ring->pages, ring->nr_pages, VM_MAP, PAGE_KERNEL);
+    if (!vaddr)
+        goto err_free_pages;
+
+    ring->ctrl = vaddr;
+    ring->data = vaddr + PAGE_SIZE;
+    mutex_init(&ring->write_lock);
+    mutex_init(&ring->read_lock);
+    init_waitqueue_head(&ring->read_wq);
+    init_waitqueue_head(&ring->write_wq);
+    ring->high = 1;
+    ring->low = ring->size - 1;
+    return 0;
+
+err_free_pages:
+    while (i--)
+        __free_page(ring->pages[i]);
+    kvfree(ring->pages);
+    return -ENOMEM;
+}
+
+static void dummy_ring_free(struct dummy_ring *ring)
+{
+    unsigned int i;
+
+    vunmap(ring->ctrl);
+    /* Pages still mapped in userspace are only freed on munmap() */
+    for (i = 0; i < ring->nr_pages; i++)
+        __free_page(ring->pages[i]);
+    kvfree(ring->pages);
+}
+
+static ssize_t cpu_show(struct device *device, struct device_attribute *attr,
+                        char *buf)
+{
+    struct dummy_dev *dev = dev_get_drvdata(device);
+
+    return sprintf(buf, "%u\n", dev->cpu);
+}
+static DEVICE_ATTR_RO(cpu);
+
+static struct attribute *dummy_attrs[] = {
+    &dev_attr_cpu.attr,
+    NULL,
+};
+ATTRIBUTE_GROUPS(dummy);
+
+static int dummy_stats_show(struct seq_file *m, void *v)
+{
+    struct dummy_dev *dev = m->private;
+    struct dummy_stats sum = { 0 };
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        struct dummy_stats *stats = per_cpu_ptr(dev->stats, cpu);
+
+        sum.opens += stats->opens;
+        sum.reads += stats->reads;
+        sum.writes += stats->writes;
+        sum.read_bytes += stats->read_bytes;
+        sum.written_bytes += stats->written_bytes;
+    }
+
+    seq_printf(m, "opens: %llu\n", sum.opens);
+    seq_printf(m, "reads: %llu\n", sum.reads);
+    seq_printf(m, "writes: %llu\n", sum.writes);
+    seq_printf(m, "read_bytes: %llu\n", sum.read_bytes);
+    seq_printf(m, "written_bytes: %llu\n", sum.written_bytes);
+    seq_printf(m, "fill_level: %u\n", dummy_ring_used(&dev->ring));
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(dummy_stats);
+
+static struct dummy_dev *dummy_dev_create(unsigned int minor, unsigned int cpu)
+{
+    int node = cpu_to_node(cpu);
+    struct dummy_dev *dev;
+    dev_t devt = MKDEV(major, minor);
+    int error;
+
+    dev = kzalloc_node(sizeof(*dev), GFP_KERNEL, node);
+    if (!dev)
+        return ERR_PTR(-ENOMEM);
+
+    dev->cpu = cpu;
+    dev->stats = alloc_percpu(struct dummy_stats);
+    if (!dev->stats) {
+        error = -ENOMEM;
+        goto err_free_dev;
+    }
+
+    error = dummy_ring_init(&dev->ring, ring_size, node);
+    if (error)
+        goto err_free_stats;
+
+    /* Initialize the char device and tie a file_operations to it */
+    cdev_init(&dev->cdev, &dummy_fops);
+    dev->cdev.owner = THIS_MODULE;
+    /* Now make the device live for the users to access */
+    error = cdev_add(&dev->cdev, devt, 1);
+    if (error)
+        goto err_free_ring;
+
+    dev->device = device_create_with_groups(dummy_class,
+                                NULL,   /* no parent device */
+                                devt,   /* associated dev_t */
+                                dev,    /* driver data, for the cpu attribute */
+                                dummy_groups,
+                                "dummy_char%u", minor); /* device name */
+    if (IS_ERR(dev->device)) {
+        error = PTR_ERR(dev->device);
+        goto err_del_cdev;
+    }
+
+    /* /sys/kernel/debug/dummy_char/dummy_charN */
+    debugfs_create_file(dev_name(dev->device), 0444, dummy_debugfs, dev,
+                        &dummy_stats_fops);
+    return dev;
+
+err_del_cdev:
+    cdev_del(&dev->cdev);
+err_free_ring:
+    dummy_ring_free(&dev->ring);
+err_free_stats:
+    free_percpu(dev->stats);
+err_free_dev:
+    kfree(dev);
+    return ERR_PTR(error);
+}
+
+static void dummy_dev_destroy(struct dummy_dev *dev)
+{
+    device_destroy(dummy_class, dev->cdev.dev);
+    cdev_del(&dev->cdev);
+    dummy_ring_free(&dev->ring);
+    free_percpu(dev->stats);
+    kfree(dev);
+}
+
 static int __init dummy_char_init_module(void)
 {
-    struct device *dummy_device;
+    unsigned int i, cpu;
     int error;
     dev_t devt = 0;
 
+    if (!ndevices)
+        ndevices = num_online_cpus();
+
+    dummy_devs = kcalloc(ndevices, sizeof(*dummy_devs), GFP_KERNEL);
+    if (!dummy_devs)
+        return -ENOMEM;
+
     /* Get a range of minor numbers (starting with 0) to work with */
-    error = alloc_chrdev_region(&devt, 0, 1, "dummy_char");
+    error = alloc_chrdev_region(&devt, 0, ndevices, "dummy_char");
     if (error < 0) {
         pr_err("Can't get major number\n");
-        return error;
+        goto err_free_devs;
     }
     major = MAJOR(devt);
     pr_info("dummy_char major number = %d\n",major);
@@ -63,39 +695,52 @@ static int __init dummy_char_init_module(void)
     dummy_class = class_create(THIS_MODULE, "dummy_char_class");
     if (IS_ERR(dummy_class)) {
         pr_err("Error creating dummy char class.\n");
-        unregister_chrdev_region(MKDEV(major, 0), 1);
-        return PTR_ERR(dummy_class);
+        error = PTR_ERR(dummy_class);
+        goto err_unregister_region;
     }
 
-    /* Initialize the char device and tie a file_operations to it */
-    cdev_init(&dummy_cdev, &dummy_fops);
-    dummy_cdev.owner = THIS_MODULE;
-    /* Now make the device live for the users to access */
-    cdev_add(&dummy_cdev, devt, 1);
+    dummy_debugfs = debugfs_create_dir("dummy_char", NULL);
 
-    dummy_device = device_create(dummy_class,
-                                NULL,   /* no parent device */
-                                devt,   /* associated dev_t */
-                                NULL,   /* no additional data */
-                                "dummy_char"); /* device name */
-
-    if (IS_ERR(dummy_device)) {
-        pr_err("Error creating dummy char device.\n");
-        class_destroy(dummy_class);
-        unregister_chrdev_region(devt, 1);
-        return -1;
+    /* Bind minors to online CPUs, round robin */
+    cpu = cpumask_first(cpu_online_mask);
+    for (i = 0; i < ndevices; i++) {
+        dummy_devs[i] = dummy_dev_create(i, cpu);
+        if (IS_ERR(dummy_devs[i])) {
+            pr_err("Error creating dummy char device %u.\n", i);
+            error = PTR_ERR(dummy_devs[i]);
+            goto err_destroy_devs;
+        }
+
+        cpu = cpumask_next(cpu, cpu_online_mask);
+        if (cpu >= nr_cpu_ids)
+            cpu = cpumask_first(cpu_online_mask);
     }
 
-    pr_info("dummy char module loaded\n");
+    pr_info("dummy char module loaded, %u devices\n", ndevices);
     return 0;
+
+err_destroy_devs:
+    debugfs_remove_recursive(dummy_debugfs);
+    while (i--)
+        dummy_dev_destroy(dummy_devs[i]);
+    class_destroy(dummy_class);
+err_unregister_region:
+    unregister_chrdev_region(devt, ndevices);
+err_free_devs:
+    kfree(dummy_devs);
+    return error;
 }
 
 static void __exit dummy_char_cleanup_module(void)
 {
-    unregister_chrdev_region(MKDEV(major, 0), 1);
-    device_destroy(dummy_class, MKDEV(major, 0));
-    cdev_del(&dummy_cdev);
+    unsigned int i;
+
+    debugfs_remove_recursive(dummy_debugfs);
+    for (i = 0; i < ndevices; i++)
+        dummy_dev_destroy(dummy_devs[i]);
     class_destroy(dummy_class);
+    unregister_chrdev_region(MKDEV(major, 0), ndevices);
+    kfree(dummy_devs);
 
     pr_info("dummy char module Unloaded\n");
 }
@@ -0,0 +1,55 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Userspace interface of the dummy char device: ioctl commands and the
+ * layout of the mmap()-able ring.
+ */
+#ifndef __DUMMY_CHAR_H
+#define __DUMMY_CHAR_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+/*
+ * The mapping starts with a control page holding the producer (head) and
+ * consumer (tail) indexes, followed by the data ring at data_offset. Both
+ * indexes are free running: (head - tail) is the number of bytes in the
+ * ring and (index & (size - 1)) the offset of a byte in the data area.
+ *
+ * A producer fills the ring then publishes head with a release store; a
+ * consumer reads head with an acquire load, consumes the data, then
+ * publishes tail with a release store. Each index lives on its own cache
+ * line so that the two sides never write to the same line.
+ */
+struct dummy_ring_ctrl {
+    __u32 head;
+    __u32 __pad0[15];
+    __u32 tail;
+    __u32 __pad1[15];
+};
+
+struct dummy_ring_info {
+    __u32 size;         /* size of the data ring, a power of two */
+    __u32 data_offset;  /* offset of the data ring in the mapping */
+};
+
+/*
+ * Wakeup thresholds, in bytes of data in the ring. Readers (blocking or
+ * polling) are woken up when the fill level reaches high, or the size of
+ * a smaller blocking read(), writers when it drops to low. Wakeups are
+ * edge-triggered: they only happen when the fill level crosses a
+ * threshold, not on every read() or write().
+ */
+struct dummy_ring_watermarks {
+    __u32 high;         /* 1 to ring size, defaults to 1 */
+    __u32 low;          /* 0 to ring size - 1, defaults to ring size - 1 */
+};
+
+#define DUMMY_IOC_MAGIC     'd'
+/* Get the ring geometry, needed to mmap() the device */
+#define DUMMY_IOC_GET_INFO  _IOR(DUMMY_IOC_MAGIC, 0, struct dummy_ring_info)
+/* Tell the driver that head or tail moved, waking up blocked peers */
+#define DUMMY_IOC_WAKE      _IO(DUMMY_IOC_MAGIC, 1)
+#define DUMMY_IOC_SET_WATERMARKS  _IOW(DUMMY_IOC_MAGIC, 2, struct dummy_ring_watermarks)
+#define DUMMY_IOC_GET_WATERMARKS  _IOR(DUMMY_IOC_MAGIC, 3, struct dummy_ring_watermarks)
+
+#endif /* __DUMMY_CHAR_H */
@@ -4,35 +4,256 @@
 #include <linux/platform_device.h>      /* For platform devices */
 #include <linux/cdev.h>
 #include <linux/fs.h>
+#include <linux/debugfs.h>
+#include <linux/idr.h>
+#include <linux/percpu.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+#include <linux/xarray.h>
 
-static unsigned int major; /* major number for device */
+#define CREATE_TRACE_POINTS
+#include "platform-dummy-char-trace.h"
+
+#define DUMMY_MAX_DEVICES   64
+
+static unsigned long capacity_mb = 1024;
+module_param(capacity_mb, ulong, 0444);
+MODULE_PARM_DESC(capacity_mb, "capacity of each device in MiB (default 1024)");
+
+/*
+ * Module wide state, shared by all the instances but never written to
+ * once the module is loaded, except for the minor allocator.
+ */
+static dev_t dummy_devt; /* first device number of our region */
 static struct class *dummy_class;
-static struct cdev dummy_cdev;
+static struct dentry *dummy_debugfs;
+static DEFINE_IDA(dummy_minors);
+
+/*
+ * Operation counters. They are per-CPU, so that the file operations never
+ * write to a shared cache line, and only summed up when read from debugfs.
+ */
+struct dummy_stats {
+    u64 opens;
+    u64 reads;
+    u64 writes;
+    u64 read_bytes;
+    u64 written_bytes;
+};
+
+/*
+ * Per platform device state, allocated in probe. The char device holds a
+ * reference on dev, so that the structure outlives a remove for as long
+ * as the device is still open.
+ *  pages - backing store, indexed by page offset in the device. A page
+ *    is only allocated on the first write to it; holes read as zeros.
+ *    Pages are never freed before the device itself, so readers and
+ *    writers only need the xarray's internal lock to insert a page.
+ *  capacity - size of the device, in bytes;
+ *  nr_pages - number of pages allocated so far.
+ */
+struct dummy_pdev {
+    struct cdev cdev;
+    struct device dev;
+    struct dentry *debugfs;
+    struct dummy_stats __percpu *stats;
+    struct xarray pages;
+    loff_t capacity;
+    atomic_long_t nr_pages;
+    unsigned int minor;
+};
+
+/*
+ * Per open file state, in filp->private_data. Nothing there is shared
+ * with other files, so the file operations do not need any lock.
+ */
+struct dummy_file {
+    struct dummy_pdev *dummy;
+};
+
+/* Only pay for timestamps when somebody listens to the tracepoint */
+static inline u64 dummy_trace_start(void)
+{
+    return trace_platform_dummy_char_op_enabled() ? ktime_get_ns() : 0;
+}
+
+static inline void dummy_trace(struct dummy_pdev *dummy, unsigned int op,
+                               size_t size, loff_t offset, u64 start,
+                               ssize_t ret)
+{
+    trace_platform_dummy_char_op(dummy->minor, op, size, offset,
+                                 start ? ktime_get_ns() - start : 0, ret);
+}
 
 int dummy_open(struct inode * inode, struct file * filp)
 {
-    pr_info("Someone tried to open me\n");
+    struct dummy_pdev *dummy = container_of(inode->i_cdev,
+                                            struct dummy_pdev, cdev);
+    struct dummy_file *file;
+
+    file = kzalloc(sizeof(*file), GFP_KERNEL);
+    if (!file)
+        return -ENOMEM;
+
+    file->dummy = dummy;
+    filp->private_data = file;
+
+    this_cpu_inc(dummy->stats->opens);
+    dummy_trace(dummy, DUMMY_OP_OPEN, 0, 0, 0, 0);
     return 0;
 }
 
 int dummy_release(struct inode * inode, struct file * filp)
 {
-    pr_info("Someone closed me\n");
+    struct dummy_file *file = filp->private_data;
+
+    dummy_trace(file->dummy, DUMMY_OP_RELEASE, 0, 0, 0, 0);
+    kfree(file);
     return 0;
 }
 
+/* Get the page backing index, allocating it if needed */
+static struct page *dummy_get_page(struct dummy_pdev *dummy, pgoff_t index)
+{
+    struct page *page, *old;
+
+    page = xa_load(&dummy->pages, index);
+    if (page)
+        return page;
+
+    page = alloc_page(GFP_KERNEL | __GFP_ZERO);
+    if (!page)
+        return ERR_PTR(-ENOMEM);
+
+    /* Somebody else may have been faster */
+    old = xa_cmpxchg(&dummy->pages, index, NULL, page, GFP_KERNEL);
+    if (old) {
+        __free_page(page);
+        return xa_is_err(old) ? ERR_PTR(xa_err(old)) : old;
+    }
+
+    atomic_long_inc(&dummy->nr_pages);
+    return page;
+}
+
 ssize_t dummy_read (struct file *filp, char __user * buf, size_t count,
                                 loff_t * offset)
 {
-    pr_info("Nothing to read guy\n");
-    return 0;
+    struct dummy_file *file = filp->private_data;
+    struct dummy_pdev *dummy = file->dummy;
+    u64 start = dummy_trace_start();
+    loff_t pos = *offset;
+    size_t done = 0, len, off;
+    struct page *page;
+    ssize_t ret = 0;
+
+    if (pos >= dummy->capacity)
+        goto out;
+    count = min_t(loff_t, count, dummy->capacity - pos);
+
+    while (done < count) {
+        off = offset_in_page(pos);
+        len = min_t(size_t, PAGE_SIZE - off, count - done);
+
+        page = xa_load(&dummy->pages, pos >> PAGE_SHIFT);
+        if (page ? copy_to_user(buf + done, page_address(page) + off, len) :
+                   clear_user(buf + done, len)) {
+            ret = -EFAULT;
+            break;
+        }
+
+        done += len;
+        pos += len;
+    }
+
+    if (done) {
+        *offset = pos;
+        this_cpu_inc(dummy->stats->reads);
+        this_cpu_add(dummy->stats->read_bytes, done);
+        ret = done;
+    }
+out:
+    dummy_trace(dummy, DUMMY_OP_READ, count, pos - done, start, ret);
+    return ret;
 }
 
 ssize_t dummy_write(struct file * filp, const char __user * buf, size_t count,
                                 loff_t * offset)
 {
-    pr_info("Can't accept any data guy\n");
-    return count;
+    struct dummy_file *file = filp->private_data;
+    struct dummy_pdev *dummy = file->dummy;
+    u64 start = dummy_trace_start();
+    loff_t pos = *offset;
+    size_t done = 0, len, off;
+    struct page *page;
+    ssize_t ret = 0;
+
+    if (pos >= dummy->capacity) {
+        /* Writing beyond the end of the device is not allowed */
+        ret = count ? -ENOSPC : 0;
+        goto out;
+    }
+    count = min_t(loff_t, count, dummy->capacity - pos);
+
+    while (done < count) {
+        off = offset_in_page(pos);
+        len = min_t(size_t, PAGE_SIZE - off, count - done);
+
+        page = dummy_get_page(dummy, pos >> PAGE_SHIFT);
+        if (IS_ERR(page)) {
+            ret = PTR_ERR(page);
+            break;
+        }
+        if (copy_from_user(page_address(page) + off, buf + done, len)) {
+            ret = -EFAULT;
+            break;
+        }
+
+        done += len;
+        pos += len;
+    }
+
+    if (done) {
+        *offset = pos;
+        this_cpu_inc(dummy->stats->writes);
+        this_cpu_add(dummy->stats->written_bytes, done);
+        ret = done;
+    }
+out:
+    dummy_trace(dummy, DUMMY_OP_WRITE, count, pos - done, start, ret);
+    return ret;
+}
+
+/*
+ * On top of the usual SEEK_SET/SEEK_CUR/SEEK_END, support SEEK_DATA and
+ * SEEK_HOLE with a page granularity, so that tools like cp --sparse=auto
+ * or tar --sparse only copy what has actually been written.
+ */
+loff_t dummy_llseek(struct file *filp, loff_t off, int whence)
+{
+    struct dummy_file *file = filp->private_data;
+    struct dummy_pdev *dummy = file->dummy;
+    unsigned long index;
+
+    if (whence != SEEK_DATA && whence != SEEK_HOLE)
+        return fixed_size_llseek(filp, off, whence, dummy->capacity);
+
+    if (off < 0 || off >= dummy->capacity)
+        return -ENXIO;
+
+    index = off >> PAGE_SHIFT;
+    if (whence == SEEK_DATA) {
+        if (!xa_find(&dummy->pages, &index,
+                     (dummy->capacity - 1) >> PAGE_SHIFT, XA_PRESENT))
+            return -ENXIO;
+    } else {
+        while (xa_load(&dummy->pages, index))
+            index++;
+    }
+
+    off = max_t(loff_t, off, (loff_t)index << PAGE_SHIFT);
+    return vfs_setpos(filp, min(off, dummy->capacity), dummy->capacity);
 }
 
 struct file_operations dummy_fops = {
@@ -40,73 +261,173 @@ struct file_operations dummy_fops = {
     release:    dummy_release,
     read:       dummy_read,
     write:      dummy_write,
+    llseek:     dummy_llseek,
 };
 
+static int dummy_stats_show(struct seq_file *m, void *v)
+{
+    struct dummy_pdev *dummy = m->private;
+    struct dummy_stats sum = { 0 };
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        struct dummy_stats *stats = per_cpu_ptr(dummy->stats, cpu);
+
+        sum.opens += stats->opens;
+        sum.reads += stats->reads;
+        sum.writes += stats->writes;
+        sum.read_bytes += stats->read_bytes;
+        sum.written_bytes += stats->written_bytes;
+    }
+
+    seq_printf(m, "opens: %llu\n", sum.opens);
+    seq_printf(m, "reads: %llu\n", sum.reads);
+    seq_printf(m, "writes: %llu\n", sum.writes);
+    seq_printf(m, "read_bytes: %llu\n", sum.read_bytes);
+    seq_printf(m, "written_bytes: %llu\n", sum.written_bytes);
+    seq_printf(m, "pages: %ld\n", atomic_long_read(&dummy->nr_pages));
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(dummy_stats);
+
+/* Called once the last reference on the char device is gone */
+static void dummy_pdev_release(struct device *dev)
+{
+    struct dummy_pdev *dummy = container_of(dev, struct dummy_pdev, dev);
+    unsigned long index;
+    struct page *page;
+
+    xa_for_each(&dummy->pages, index, page)
+        __free_page(page);
+    xa_destroy(&dummy->pages);
+    ida_free(&dummy_minors, dummy->minor);
+    free_percpu(dummy->stats);
+    kfree(dummy);
+}
+
 static int my_pdrv_probe (struct platform_device *pdev)
 {
-        struct device *dummy_device;
+    struct dummy_pdev *dummy;
+    int minor, error;
+
+    minor = ida_alloc_max(&dummy_minors, DUMMY_MAX_DEVICES - 1, GFP_KERNEL);
+    if (minor < 0)
+        return minor;
+
+    dummy = kzalloc(sizeof(*dummy), GFP_KERNEL);
+    if (!dummy) {
+        ida_free(&dummy_minors, minor);
+        return -ENOMEM;
+    }
+
+    /* From now on, dummy_pdev_release() undoes everything on put_device() */
+    dummy->minor = minor;
+    xa_init(&dummy->pages);
+    dummy->capacity = (loff_t)capacity_mb << 20;
+    device_initialize(&dummy->dev);
+    dummy->dev.class = dummy_class;
+    dummy->dev.parent = &pdev->dev;
+    dummy->dev.devt = MKDEV(MAJOR(dummy_devt), minor);
+    dummy->dev.release = dummy_pdev_release;
+
+    dummy->stats = alloc_percpu(struct dummy_stats);
+    if (!dummy->stats) {
+        error = -ENOMEM;
+        goto err_put_device;
+    }
+
+    error = dev_set_name(&dummy->dev, "dummy_char%d", minor);
+    if (error)
+        goto err_put_device;
+
+    /* Initialize the char device and tie a file_operations to it */
+    cdev_init(&dummy->cdev, &dummy_fops);
+    dummy->cdev.owner = THIS_MODULE;
+    /* Now make the device live for the users to access */
+    error = cdev_device_add(&dummy->cdev, &dummy->dev);
+    if (error) {
+        dev_err(&pdev->dev, "Error creating dummy char device.\n");
+        goto err_put_device;
+    }
+
+    /* /sys/kernel/debug/platform_dummy_char/dummy_charN */
+    dummy->debugfs = debugfs_create_file(dev_name(&dummy->dev), 0444,
+                                         dummy_debugfs, dummy,
+                                         &dummy_stats_fops);
+
+    platform_set_drvdata(pdev, dummy);
+    dev_info(&pdev->dev, "%s created\n", dev_name(&dummy->dev));
+    return 0;
+
+err_put_device:
+    put_device(&dummy->dev);
+    return error;
+}
+
+static int my_pdrv_remove(struct platform_device *pdev)
+{
+    struct dummy_pdev *dummy = platform_get_drvdata(pdev);
+
+    debugfs_remove(dummy->debugfs);
+    cdev_device_del(&dummy->cdev, &dummy->dev);
+    put_device(&dummy->dev);
+    return 0;
+}
+
+static struct platform_driver mypdrv = {
+    .probe      = my_pdrv_probe,
+    .remove     = my_pdrv_remove,
+    .driver     = {
+        .name     = "platform-dummy-char",
+        .owner    = THIS_MODULE,
+    },
+};
+
+static int __init my_pdrv_init(void)
+{
     int error;
-    dev_t devt = 0;
 
     /* Get a range of minor numbers (starting with 0) to work with */
-    error = alloc_chrdev_region(&devt, 0, 1, "dummy_char");
+    error = alloc_chrdev_region(&dummy_devt, 0, DUMMY_MAX_DEVICES, "dummy_char");
     if (error < 0) {
         pr_err("Can't get major number\n");
         return error;
     }
-    major = MAJOR(devt);
-    pr_info("dummy_char major number = %d\n",major);
+    pr_info("dummy_char major number = %d\n", MAJOR(dummy_devt));
 
     /* Create device class, visible in /sys/class */
     dummy_class = class_create(THIS_MODULE, "dummy_char_class");
     if (IS_ERR(dummy_class)) {
-        pr_err("Error creating sdma test module class.\n");
-        unregister_chrdev_region(MKDEV(major, 0), 1);
+        pr_err("Error creating dummy char class.\n");
+        unregister_chrdev_region(dummy_devt, DUMMY_MAX_DEVICES);
         return PTR_ERR(dummy_class);
     }
 
-    /* Initialize the char device and tie a file_operations to it */
-    cdev_init(&dummy_cdev, &dummy_fops);
-    dummy_cdev.owner = THIS_MODULE;
-    /* Now make the device live for the users to access */
-    cdev_add(&dummy_cdev, devt, 1);
-
-    dummy_device = device_create(dummy_class,
-                                &pdev->dev,   /* no parent device */
-                                devt,    /* associated dev_t */
-                                NULL,   /* no additional data */
-                                "dummy_char");  /* device name */
+    dummy_debugfs = debugfs_create_dir("platform_dummy_char", NULL);
 
-    if (IS_ERR(dummy_device)) {
-        pr_err("Error creating sdma test class device.\n");
+    error = platform_driver_register(&mypdrv);
+    if (error) {
+        debugfs_remove_recursive(dummy_debugfs);
         class_destroy(dummy_class);
-        unregister_chrdev_region(devt, 1);
-        return -1;
+        unregister_chrdev_region(dummy_devt, DUMMY_MAX_DEVICES);
+        return error;
     }
 
     pr_info("dummy char module loaded\n");
     return 0;
 }
 
-static int my_pdrv_remove(struct platform_device *pdev)
+static void __exit my_pdrv_exit(void)
 {
-    unregister_chrdev_region(MKDEV(major, 0), 1);
-    device_destroy(dummy_class, MKDEV(major, 0));
-    cdev_del(&dummy_cdev);
+    platform_driver_unregister(&mypdrv);
+    debugfs_remove_recursive(dummy_debugfs);
     class_destroy(dummy_class);
+    unregister_chrdev_region(dummy_devt, DUMMY_MAX_DEVICES);
 
     pr_info("dummy char module Unloaded\n");
-    return 0;
 }
 
-static struct platform_driver mypdrv = {
-    .probe      = my_pdrv_probe,
-    .remove     = my_pdrv_remove,
-    .driver     = {
-        .name     = "platform-dummy-char",
-        .owner    = THIS_MODULE,
-    },
-};
-module_platform_driver(mypdrv);
+module_init(my_pdrv_init);
+module_exit(my_pdrv_exit);
 MODULE_AUTHOR("John Madieu <john.madieu@gmail.com>");
 MODULE_LICENSE("GPL");
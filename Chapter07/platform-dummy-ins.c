@@ -1,22 +1,43 @@
 #include <linux/platform_device.h>
 #include <linux/module.h>
 #include <linux/types.h>
+#include <linux/err.h>
 
-static struct platform_device *pdev;
+#define MAX_INSTANCES   64
+
+static unsigned int instances = 1;
+module_param(instances, uint, 0444);
+MODULE_PARM_DESC(instances, "number of platform-dummy-char devices to add (default 1)");
+
+static struct platform_device *pdevs[MAX_INSTANCES];
 
 static int __init platform_dummy_char_add(void)
 {
-    int inst_id = 0; /* instance unique ID: base address would be a good choice */
-    pdev = platform_device_alloc("platform-dummy-char", inst_id);
-    platform_device_add(pdev);
-    pr_info("platform-dummy-char device added\n");
+    int inst_id; /* instance unique ID: base address would be a good choice */
+
+    instances = clamp(instances, 1U, (unsigned int)MAX_INSTANCES);
+    for (inst_id = 0; inst_id < instances; inst_id++) {
+        pdevs[inst_id] = platform_device_register_simple("platform-dummy-char",
+                                                         inst_id, NULL, 0);
+        if (IS_ERR(pdevs[inst_id])) {
+            int err = PTR_ERR(pdevs[inst_id]);
+
+            while (inst_id--)
+                platform_device_unregister(pdevs[inst_id]);
+            return err;
+        }
+    }
+    pr_info("%u platform-dummy-char device(s) added\n", instances);
     return 0;
 }
 
 static void __exit fplatform_dummy_char_put(void)
 {
-    pr_info("platform-dummy-char device removed\n");
-	platform_device_put(pdev);
+    int inst_id;
+
+    pr_info("platform-dummy-char device(s) removed\n");
+    for (inst_id = 0; inst_id < instances; inst_id++)
+        platform_device_unregister(pdevs[inst_id]);
 }
 
 module_init(platform_dummy_char_add);
@@ -0,0 +1,219 @@
+/*
+ * Software I2C adapter with a 24LC512 EEPROM on it, to test and benchmark
+ * the ee24lc512 driver without the real chip.
+ *
+ * i2c-stub cannot stand in for this chip: it only emulates SMBus register
+ * devices with 8-bit commands, whereas the 24LC512 is accessed with plain
+ * I2C messages and a 16-bit address. This module registers an adapter,
+ * named "ee24lc512-stub", emulating the chip protocol:
+ *  - a write message carries the address, high byte first, then data
+ *    bytes; data is latched in the page buffer, wrapping around within the
+ *    128-byte page, and programmed at the end of the transfer (STOP);
+ *  - programming takes twc_us microseconds, during which the chip does not
+ *    acknowledge its address (-ENXIO), as real chips do;
+ *  - a read message streams data out from the address pointer, rolling
+ *    over at the end of the memory;
+ *  - I2C_M_NOSTART write messages continue the previous one.
+ *
+ * The memory content survives rebinding the driver, and is lost when this
+ * module is unloaded. It can be read at any time, bypassing the driver,
+ * from /sys/kernel/debug/ee24lc512-stub/mem. The clients are instantiated
+ * from userspace, see ee24lc512-test.sh.
+ */
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/i2c.h>
+#include <linux/delay.h>
+#include <linux/ktime.h>
+#include <linux/debugfs.h>
+
+#define STUB_SIZE           (64 * 1024)
+#define STUB_PAGE_SIZE      128
+
+static unsigned short chip_addr = 0x50;
+module_param(chip_addr, ushort, 0444);
+MODULE_PARM_DESC(chip_addr, "I2C address of the emulated chip (default 0x50)");
+
+static unsigned int twc_us = 5000;
+module_param(twc_us, uint, 0644);
+MODULE_PARM_DESC(twc_us, "write cycle time in us (default 5000)");
+
+static unsigned int bus_khz;
+module_param(bus_khz, uint, 0644);
+MODULE_PARM_DESC(bus_khz, "simulated bus clock in kHz, 0 for no bus delay (default 0)");
+
+static bool nostart = true;
+module_param(nostart, bool, 0444);
+MODULE_PARM_DESC(nostart, "advertise I2C_FUNC_NOSTART (default 1)");
+
+static unsigned int max_read_len;
+module_param(max_read_len, uint, 0444);
+MODULE_PARM_DESC(max_read_len, "max read message length quirk, 0 for none (default 0)");
+
+/*
+ * State of the emulated chip. Transfers are serialized by the I2C core,
+ * which holds the adapter lock around master_xfer.
+ *  mem - the memory array;
+ *  ptr - internal address pointer;
+ *  latch, latched - page buffer and which of its bytes were written;
+ *  page - page the latch belongs to;
+ *  wr_bytes - bytes received in the current write, address included;
+ *  busy_until - end of the ongoing write cycle.
+ */
+struct stub_chip {
+    u8 mem[STUB_SIZE];
+    unsigned int ptr;
+    u8 latch[STUB_PAGE_SIZE];
+    DECLARE_BITMAP(latched, STUB_PAGE_SIZE);
+    unsigned int page;
+    unsigned int wr_bytes;
+    ktime_t busy_until;
+};
+
+static struct stub_chip *chip;
+static struct i2c_adapter stub_adapter;
+static struct i2c_adapter_quirks stub_quirks;
+static struct debugfs_blob_wrapper stub_blob;
+static struct dentry *stub_debugfs;
+
+/* Program the latched bytes, on STOP or repeated START */
+static void stub_end_write(void)
+{
+    unsigned int i;
+
+    if (chip->wr_bytes > 2) {
+        for_each_set_bit(i, chip->latched, STUB_PAGE_SIZE)
+            chip->mem[chip->page + i] = chip->latch[i];
+        chip->busy_until = ktime_add_us(ktime_get(), twc_us);
+    }
+    bitmap_zero(chip->latched, STUB_PAGE_SIZE);
+    chip->wr_bytes = 0;
+}
+
+static void stub_write_byte(u8 b)
+{
+    unsigned int off;
+
+    switch (chip->wr_bytes++) {
+    case 0:
+        chip->ptr = (b << 8) | (chip->ptr & 0xff);
+        break;
+    case 1:
+        chip->ptr = (chip->ptr & 0xff00) | b;
+        chip->page = chip->ptr & ~(STUB_PAGE_SIZE - 1);
+        break;
+    default:
+        /* The address pointer rolls over within the page */
+        off = chip->ptr & (STUB_PAGE_SIZE - 1);
+        chip->latch[off] = b;
+        set_bit(off, chip->latched);
+        chip->ptr = chip->page + ((off + 1) & (STUB_PAGE_SIZE - 1));
+        break;
+    }
+}
+
+/* Time the transfer would take on a real bus: 9 clocks per byte */
+static void stub_bus_delay(struct i2c_msg *msgs, int num)
+{
+    unsigned long bits = 0, us;
+    int i;
+
+    if (!bus_khz)
+        return;
+    for (i = 0; i < num; i++)
+        bits += (msgs[i].len + 1) * 9;
+    us = bits * 1000 / bus_khz;
+    if (us > 10)
+        usleep_range(us, us + 10);
+    else
+        udelay(us);
+}
+
+static int stub_xfer(struct i2c_adapter *adap, struct i2c_msg *msgs, int num)
+{
+    int i, j;
+
+    stub_bus_delay(msgs, num);
+
+    for (i = 0; i < num; i++) {
+        struct i2c_msg *msg = &msgs[i];
+
+        /* Anything but a NOSTART continuation is a (repeated) START */
+        if (!(msg->flags & I2C_M_NOSTART)) {
+            stub_end_write();
+            /* Nobody at that address, or programming: no ACK */
+            if (msg->addr != chip_addr ||
+                ktime_before(ktime_get(), chip->busy_until)) {
+                return -ENXIO;
+            }
+        }
+
+        if (msg->flags & I2C_M_RD) {
+            for (j = 0; j < msg->len; j++) {
+                msg->buf[j] = chip->mem[chip->ptr];
+                chip->ptr = (chip->ptr + 1) % STUB_SIZE;
+            }
+        } else {
+            for (j = 0; j < msg->len; j++)
+                stub_write_byte(msg->buf[j]);
+        }
+    }
+    stub_end_write();     /* STOP */
+    return num;
+}
+
+static u32 stub_func(struct i2c_adapter *adap)
+{
+    return I2C_FUNC_I2C | (nostart ? I2C_FUNC_NOSTART : 0);
+}
+
+static const struct i2c_algorithm stub_algorithm = {
+    .master_xfer = stub_xfer,
+    .functionality = stub_func,
+};
+
+static int __init stub_init(void)
+{
+    int ret;
+
+    chip = kzalloc(sizeof(*chip), GFP_KERNEL);
+    if (!chip)
+        return -ENOMEM;
+    /* Erased EEPROM cells read as 0xff */
+    memset(chip->mem, 0xff, STUB_SIZE);
+
+    stub_adapter.owner = THIS_MODULE;
+    stub_adapter.algo = &stub_algorithm;
+    strscpy(stub_adapter.name, "ee24lc512-stub", sizeof(stub_adapter.name));
+    if (max_read_len) {
+        stub_quirks.max_read_len = max_read_len;
+        stub_adapter.quirks = &stub_quirks;
+    }
+
+    ret = i2c_add_adapter(&stub_adapter);
+    if (ret) {
+        kfree(chip);
+        return ret;
+    }
+    stub_blob.data = chip->mem;
+    stub_blob.size = STUB_SIZE;
+    stub_debugfs = debugfs_create_dir("ee24lc512-stub", NULL);
+    debugfs_create_blob("mem", 0400, stub_debugfs, &stub_blob);
+
+    pr_info("ee24lc512-stub: chip at 0x%02x on i2c-%d\n", chip_addr,
+            stub_adapter.nr);
+    return 0;
+}
+module_init(stub_init);
+
+static void __exit stub_exit(void)
+{
+    debugfs_remove_recursive(stub_debugfs);
+    i2c_del_adapter(&stub_adapter);
+    kfree(chip);
+}
+module_exit(stub_exit);
+
+MODULE_DESCRIPTION("Emulated 24LC512 EEPROM on a software I2C adapter");
+MODULE_LICENSE("GPL");
@@ -0,0 +1,329 @@
+/*
+ * Correctness tests and benchmark for the ee24lc512 driver, run against the
+ * emulated chip of ee24lc512-stub.ko. What reached the chip is checked by
+ * reading the stub memory straight from debugfs, bypassing the driver.
+ *
+ * The modes are:
+ *  test  - writes within, across and at the edges of pages and of the
+ *          device, through the default, O_DSYNC and async write paths,
+ *          write suppression of unchanged data, and llseek edge cases;
+ *  read  - time a full device read, twice: the first one comes from the
+ *          chip if the driver was just bound, the second from its cache;
+ *  write - time a full device write, fsync() included.
+ *
+ * Build with "make test-prog", or use ee24lc512-test.sh, as root.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "ee24lc512.h"
+
+#define EEP_SIZE        (64 * 1024)
+#define EEP_PAGE_SIZE   128
+#define STUB_MEM        "/sys/kernel/debug/ee24lc512-stub/mem"
+#define STAT_FMT        "/sys/class/eeprom/%s/%s"
+
+static const char *dev_path;
+static unsigned char ref[EEP_SIZE];     /* what the chip should hold */
+static int failures;
+
+#define CHECK(cond, ...)                                    \
+    do {                                                    \
+        if (!(cond)) {                                      \
+            fprintf(stderr, "FAIL %s:%d: ", __func__, __LINE__); \
+            fprintf(stderr, __VA_ARGS__);                   \
+            fputc('\n', stderr);                            \
+            failures++;                                     \
+        }                                                   \
+    } while (0)
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int open_dev(int flags)
+{
+    int fd = open(dev_path, flags);
+
+    if (fd < 0) {
+        perror(dev_path);
+        exit(1);
+    }
+    return fd;
+}
+
+static void fill_random(unsigned char *buf, size_t len)
+{
+    while (len--)
+        *buf++ = rand();
+}
+
+/* Compare the whole chip, as seen by the stub, with ref */
+static void check_chip(const char *what)
+{
+    static unsigned char mem[EEP_SIZE];
+    int fd = open(STUB_MEM, O_RDONLY);
+    ssize_t n;
+    int i;
+
+    if (fd < 0) {
+        perror(STUB_MEM);
+        exit(1);
+    }
+    n = pread(fd, mem, EEP_SIZE, 0);
+    close(fd);
+    CHECK(n == EEP_SIZE, "%s: short stub read %zd", what, n);
+    for (i = 0; i < EEP_SIZE; i++)
+        if (mem[i] != ref[i])
+            break;
+    CHECK(i == EEP_SIZE, "%s: chip differs at 0x%04x: 0x%02x, expected 0x%02x",
+          what, i, mem[i], ref[i]);
+}
+
+/* Compare the device, as seen through the driver, with ref */
+static void check_dev(int fd, const char *what)
+{
+    static unsigned char buf[EEP_SIZE];
+    ssize_t n = pread(fd, buf, EEP_SIZE, 0);
+
+    CHECK(n == EEP_SIZE, "%s: read returned %zd", what, n);
+    CHECK(!memcmp(buf, ref, EEP_SIZE), "%s: read back differs", what);
+}
+
+/*
+ * Write len random bytes at off, check what is read back, then that the
+ * data reaches the chip once synced.
+ */
+static void write_case(int fd, unsigned int off, unsigned int len, int sync)
+{
+    unsigned char buf[EEP_SIZE];
+    unsigned int expected = off + len > EEP_SIZE ? EEP_SIZE - off : len;
+    char what[64];
+    ssize_t n;
+
+    snprintf(what, sizeof(what), "write %u@0x%04x", len, off);
+    fill_random(buf, len);
+    n = pwrite(fd, buf, len, off);
+    CHECK(n == (ssize_t)expected, "%s: returned %zd, expected %u", what, n,
+          expected);
+    if (n > 0)
+        memcpy(ref + off, buf, n);
+
+    check_dev(fd, what);
+    if (sync == 1)
+        CHECK(!fsync(fd), "%s: fsync: %s", what, strerror(errno));
+    else if (sync == 2)
+        CHECK(!ioctl(fd, EEP_IOC_SYNC), "%s: sync ioctl: %s", what,
+              strerror(errno));
+    check_chip(what);
+}
+
+static const struct {
+    unsigned int off, len;
+} cases[] = {
+    { 0, 1 },                           /* single byte */
+    { 5, 10 },                          /* inside a page */
+    { 127, 1 },                         /* last byte of a page */
+    { 120, 16 },                        /* across a page boundary */
+    { 128, EEP_PAGE_SIZE },             /* exactly one page */
+    { 250, 300 },                       /* unaligned, several pages */
+    { 1024, 8 * EEP_PAGE_SIZE },        /* aligned, several pages */
+    { EEP_SIZE - 6, 6 },                /* up to the end */
+    { EEP_SIZE - 6, 20 },               /* past the end: truncated */
+    { 0, EEP_SIZE },                    /* everything */
+};
+
+static void test_writes(void)
+{
+    unsigned int i;
+    int fd;
+
+    /* Default mode, synced with fsync() */
+    fd = open_dev(O_RDWR);
+    for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+        write_case(fd, cases[i].off, cases[i].len, 1);
+    close(fd);
+
+    /* O_DSYNC: on the chip when write() returns */
+    fd = open_dev(O_RDWR | O_DSYNC);
+    for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+        write_case(fd, cases[i].off, cases[i].len, 0);
+    close(fd);
+
+    /* Async mode, synced with the ioctl */
+    fd = open_dev(O_RDWR);
+    CHECK(!ioctl(fd, EEP_IOC_SET_ASYNC, 1), "set async: %s", strerror(errno));
+    for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+        write_case(fd, cases[i].off, cases[i].len, 2);
+    close(fd);
+}
+
+static unsigned long read_stat(const char *name)
+{
+    const char *dev_name = strrchr(dev_path, '/');
+    unsigned long val = 0;
+    char path[128];
+    FILE *f;
+
+    snprintf(path, sizeof(path), STAT_FMT,
+             dev_name ? dev_name + 1 : dev_path, name);
+    f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        exit(1);
+    }
+    if (fscanf(f, "%lu", &val) != 1)
+        CHECK(0, "cannot parse %s", path);
+    fclose(f);
+    return val;
+}
+
+static void test_wear(void)
+{
+    unsigned long written, skipped, bytes;
+    int fd = open_dev(O_RDWR);
+
+    /* Rewriting the current content programs nothing */
+    written = read_stat("pages_written");
+    skipped = read_stat("pages_skipped");
+    CHECK(pwrite(fd, ref, EEP_SIZE, 0) == EEP_SIZE, "rewrite everything");
+    CHECK(!fsync(fd), "fsync: %s", strerror(errno));
+    CHECK(read_stat("pages_written") == written, "unchanged pages programmed");
+    CHECK(read_stat("pages_skipped") == skipped + EEP_SIZE / EEP_PAGE_SIZE,
+          "unchanged pages not counted as skipped");
+
+    /* A single changed byte in a full page write programs that byte */
+    bytes = read_stat("bytes_programmed");
+    ref[300] ^= 0xff;
+    CHECK(pwrite(fd, ref + 256, EEP_PAGE_SIZE, 256) == EEP_PAGE_SIZE,
+          "page write");
+    CHECK(!fsync(fd), "fsync: %s", strerror(errno));
+    CHECK(read_stat("pages_written") == written + 1, "one page programmed");
+    CHECK(read_stat("bytes_programmed") == bytes + 1, "one byte programmed");
+    check_chip("one byte changed");
+
+    /* Two bytes far apart: what is in between is programmed too */
+    ref[1025] ^= 0x55;
+    ref[1031] ^= 0xaa;
+    CHECK(pwrite(fd, ref + 1025, 7, 1025) == 7, "partial page write");
+    CHECK(!fsync(fd), "fsync: %s", strerror(errno));
+    CHECK(read_stat("bytes_programmed") == bytes + 1 + 7,
+          "changed range not programmed");
+    check_chip("two bytes changed");
+    close(fd);
+}
+
+static void test_edges(void)
+{
+    unsigned char buf[16];
+    int fd = open_dev(O_RDWR);
+
+    CHECK(lseek(fd, EEP_SIZE, SEEK_SET) == EEP_SIZE, "seek to the end");
+    CHECK(read(fd, buf, sizeof(buf)) == 0, "read at the end is not EOF");
+    CHECK(write(fd, buf, 1) < 0 && errno == EINVAL,
+          "write at the end did not fail with EINVAL");
+    CHECK(lseek(fd, EEP_SIZE + 1, SEEK_SET) < 0 && errno == EINVAL,
+          "seek past the end did not fail with EINVAL");
+    CHECK(lseek(fd, 0, SEEK_CUR) == EEP_SIZE, "failed seek moved the offset");
+    CHECK(lseek(fd, -EEP_SIZE, SEEK_CUR) == 0, "relative seek back to 0");
+    CHECK(lseek(fd, -1, SEEK_CUR) < 0 && errno == EINVAL,
+          "seek before 0 did not fail with EINVAL");
+    CHECK(lseek(fd, 100, SEEK_SET) == 100, "seek to 100");
+    CHECK(read(fd, buf, 10) == 10 && !memcmp(buf, ref + 100, 10),
+          "read at 100");
+    CHECK(lseek(fd, 0, SEEK_CUR) == 110, "read did not advance the offset");
+    close(fd);
+}
+
+static int run_tests(void)
+{
+    int fd = open(STUB_MEM, O_RDONLY);
+
+    if (fd < 0 || pread(fd, ref, EEP_SIZE, 0) != EEP_SIZE) {
+        perror(STUB_MEM);
+        return 1;
+    }
+    close(fd);
+    srand(getpid());
+
+    test_writes();
+    test_wear();
+    test_edges();
+
+    printf("%s\n", failures ? "FAILED" : "PASSED");
+    return !!failures;
+}
+
+static void report(const char *what, size_t bytes, uint64_t ns)
+{
+    printf("%-12s %8zu bytes %10.3f ms %10.1f kB/s\n", what, bytes,
+           ns / 1e6, bytes / 1e3 / (ns / 1e9));
+}
+
+static int run_read(void)
+{
+    static unsigned char buf[EEP_SIZE];
+    int fd = open_dev(O_RDONLY);
+    uint64_t t;
+    ssize_t n;
+
+    t = now_ns();
+    n = pread(fd, buf, EEP_SIZE, 0);
+    report("read cold", n, now_ns() - t);
+    t = now_ns();
+    n = pread(fd, buf, EEP_SIZE, 0);
+    report("read cached", n, now_ns() - t);
+    close(fd);
+    return n != EEP_SIZE;
+}
+
+static int run_write(void)
+{
+    static unsigned char buf[EEP_SIZE];
+    int fd = open_dev(O_RDWR);
+    uint64_t t;
+    ssize_t n;
+    int ret;
+
+    fill_random(buf, EEP_SIZE);
+    t = now_ns();
+    n = pwrite(fd, buf, EEP_SIZE, 0);
+    ret = fsync(fd);
+    report("write+fsync", n, now_ns() - t);
+    close(fd);
+    return n != EEP_SIZE || ret;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s test|read|write DEVICE\n", prog);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 3)
+        usage(argv[0]);
+    dev_path = argv[2];
+
+    if (!strcmp(argv[1], "test"))
+        return run_tests();
+    if (!strcmp(argv[1], "read"))
+        return run_read();
+    if (!strcmp(argv[1], "write"))
+        return run_write();
+    usage(argv[0]);
+    return 1;
+}
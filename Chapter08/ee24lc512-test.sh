@@ -0,0 +1,77 @@
+#!/bin/sh
+# Run the ee24lc512 tests, and optionally the benchmark, against the
+# emulated chip of ee24lc512-stub.ko. Run as root from this directory,
+# after "make && make test-prog".
+#
+# usage: ./ee24lc512-test.sh [-b] [-t twc_us] [-k bus_khz] [-q max_read_len]
+#   -b  also run the benchmark
+#   -t  write cycle time of the emulated chip in us (default 5000)
+#   -k  simulated bus clock in kHz, 0 for an infinitely fast bus (default 0)
+#   -q  max read message length of the adapter, 0 for no limit (default 0)
+set -e
+
+addr=0x50
+bench=0
+twc_us=5000
+bus_khz=0
+max_read_len=0
+
+while getopts "bt:k:q:" opt; do
+    case $opt in
+    b) bench=1 ;;
+    t) twc_us=$OPTARG ;;
+    k) bus_khz=$OPTARG ;;
+    q) max_read_len=$OPTARG ;;
+    *) sed -n 's/^# \{0,1\}//; 6,10p' "$0" >&2; exit 1 ;;
+    esac
+done
+
+bus=
+cleanup() {
+    [ -n "$bus" ] && echo $addr > $bus/delete_device 2>/dev/null
+    rmmod ee24lc512 2>/dev/null
+    rmmod ee24lc512-stub 2>/dev/null
+    true
+}
+trap cleanup EXIT
+
+insmod ./ee24lc512-stub.ko chip_addr=$addr twc_us=$twc_us bus_khz=$bus_khz \
+    max_read_len=$max_read_len
+insmod ./ee24lc512.ko
+
+for b in /sys/bus/i2c/devices/i2c-*; do
+    [ "$(cat $b/name)" = ee24lc512-stub ] && bus=$b
+done
+if [ -z "$bus" ]; then
+    echo "ee24lc512-stub adapter not found" >&2
+    exit 1
+fi
+client=$bus/$(printf '%d-%04x' ${bus##*i2c-} $addr)
+
+# Instantiate the chip, and wait for its device node
+bind() {
+    echo ee24lc512 $addr > $bus/new_device
+    dev=/dev/$(ls $client/eeprom)
+    tries=50
+    while [ ! -c $dev ] && [ $tries -gt 0 ]; do
+        sleep 0.1
+        tries=$((tries - 1))
+    done
+}
+
+unbind() {
+    echo $addr > $bus/delete_device
+}
+
+bind
+echo "testing $dev"
+./ee24lc512-test test $dev
+
+if [ $bench = 1 ]; then
+    echo "benchmark: twc_us=$twc_us bus_khz=$bus_khz max_read_len=$max_read_len"
+    ./ee24lc512-test write $dev
+    # Start over with an empty driver cache, for the cold read
+    unbind
+    bind
+    ./ee24lc512-test read $dev
+fi
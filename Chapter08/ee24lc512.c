@@ -9,78 +9,140 @@
 #include <linux/device.h>
 #include <linux/mutex.h>
 #include <linux/i2c.h>
+#include <linux/regmap.h>
+#include <linux/nvmem-provider.h>
 #include <linux/list.h>
+#include <linux/idr.h>
 #include <linux/delay.h>
+#include <linux/jiffies.h>
+#include <linux/bitmap.h>
+#include <linux/workqueue.h>
+#include <linux/compat.h>
 #include <asm/uaccess.h>
 
+#include "ee24lc512.h"
+
+
+#define EEP_DEVICE_NAME     "packt-mem"
+#define EEP_MINORS          256
+#define EEP_PAGE_SIZE           128
+#define EEP_SIZE            1024*64 /* 24LC512 is 64KB sized */
+#define EEP_NR_PAGES        (EEP_SIZE / EEP_PAGE_SIZE)
+/* The write cycle (Twc) lasts 5ms at most, leave some margin */
+#define EEP_WRITE_TIMEOUT_MS    25
 
 /* 
  * The structure to represent 'eep_dev' devices.
- *  data - data buffer;
- *  block_size - maximum number of bytes that can be read or written 
- *    in one call;
+ *  shadow - copy of the chip content, kept for the device lifetime;
+ *  valid - pages of the shadow that have been read from the chip;
+ *  dirty - pages of the shadow not written back to the chip yet;
+ *  dirty_lo, dirty_hi - first and last modified byte of each dirty page;
+ *  pages_written, pages_skipped, bytes_programmed - wear statistics, see
+ *    eep_store();
+ *  writeback - delayed work writing the dirty pages back;
+ *  wq - ordered workqueue running writeback and apply;
+ *  pending - writes queued by files in async mode, oldest first;
+ *  pending_bytes - amount of data in pending;
+ *  pending_lock - protects pending and pending_bytes, never held for I/O;
+ *  apply - work moving pending writes to the shadow;
+ *  async_err - first error hit by a pending write, reported on sync;
+ *  regmap - register map of the chip, one 8-bit register per byte;
+ *  nvmem - nvmem provider for in-kernel consumers and sysfs;
+ *  wbuf - DMA-safe bounce buffer for page writes, address included;
  *  eep_mutex - a mutex to protect this device;
- *  users: the number of time this device is being opened
+ *  gone - the chip was unbound, set with both eep_mutex and pending_lock
+ *    held; files still open then get -ENODEV;
+ *  cdev, dev - the char device, dev being refcounted by open files;
+ *  minor - minor number, allocated from eep_minors.
  */
 struct eep_dev {
-    unsigned char *data;
+    unsigned char *shadow;
+    DECLARE_BITMAP(valid, EEP_NR_PAGES);
+    DECLARE_BITMAP(dirty, EEP_NR_PAGES);
+    u8 dirty_lo[EEP_NR_PAGES];
+    u8 dirty_hi[EEP_NR_PAGES];
+    unsigned long pages_written;
+    unsigned long pages_skipped;
+    unsigned long bytes_programmed;
+    struct delayed_work writeback;
+    struct workqueue_struct *wq;
+    struct list_head pending;
+    size_t pending_bytes;
+    struct mutex pending_lock;
+    struct work_struct apply;
+    int async_err;
+    struct regmap *regmap;
+    struct nvmem_config nvmem_config;
+    struct nvmem_device *nvmem;
+    unsigned char *wbuf;
     struct i2c_client *client;
     struct mutex eep_mutex;
-    struct list_head    device_entry;
-    dev_t       devt;
-    unsigned    users;
+    bool gone;
+    struct cdev cdev;
+    struct device dev;
+    int minor;
 };
 
-static LIST_HEAD(device_list);
-static DEFINE_MUTEX(device_list_lock);
+/* A write queued by a file in async mode */
+struct eep_pending {
+    struct list_head node;
+    unsigned int pos;
+    unsigned int len;
+    unsigned char data[];
+};
 
-#define EEP_DEVICE_NAME     "packt-mem"
-#define EEP_PAGE_SIZE           128
-#define EEP_SIZE            1024*64 /* 24LC512 is 64KB sized */
+/*
+ * Per open file state.
+ *  eeprom - the device;
+ *  async - writes are queued and acknowledged right away.
+ */
+struct eep_file {
+    struct eep_dev *eeprom;
+    bool async;
+};
+
+static dev_t eep_devt;
+static DEFINE_IDA(eep_minors);
+
+static unsigned int writeback_ms = 1000;
+module_param(writeback_ms, uint, 0644);
+MODULE_PARM_DESC(writeback_ms, "delay before dirty pages are written back, in ms (default 1000)");
+
+static unsigned int read_chunk;
+module_param(read_chunk, uint, 0644);
+MODULE_PARM_DESC(read_chunk, "largest read transfer in bytes, 0 for the adapter limit (default 0)");
+
+/*
+ * The chip looks like 64K 8-bit registers behind a 16-bit address. There
+ * is no register cache: the shadow already caches whole pages and tracks
+ * what is dirty, whereas a regmap cache would turn bulk reads of uncached
+ * areas into one transfer per byte.
+ */
+static const struct regmap_config eep_regmap_config = {
+    .reg_bits = 16,
+    .val_bits = 8,
+    .max_register = EEP_SIZE - 1,
+    .cache_type = REGCACHE_NONE,
+};
 
 static struct class *eep_class = NULL;
-static int probed_ndevices = 0;
+
+static void eep_apply_pending(struct eep_dev *eeprom);
 
 int  eep_open(struct inode *inode, struct file *filp)
 {
-    struct eep_dev *eeprom = NULL;
-    int         err = -ENXIO;
-
-    mutex_lock(&device_list_lock);
-    list_for_each_entry(eeprom, &device_list, device_entry) {
-        if (eeprom->devt == inode->i_rdev) {
-            err = 0;
-            break;
-        }
-    }
-
-    if (err) {
-        pr_warn("eeprom: nothing for major %d\n", imajor(inode));
-        goto err_find_dev;
-    }
+    /* The open file holds a reference on dev through the cdev */
+    struct eep_dev *eeprom = container_of(inode->i_cdev, struct eep_dev, cdev);
+    struct eep_file *ef;
 
-    /* if opened the 1st time, allocate the buffer */
-    if (eeprom->data == NULL) {
-        eeprom->data = kzalloc(EEP_SIZE, GFP_KERNEL);
-        if (!eeprom->data) {
-            pr_err("[target] open(): out of memory\n");
-            err = -ENOMEM;
-            goto err_alloc_data_buf;
-        }
-    }
+    ef = kzalloc(sizeof(*ef), GFP_KERNEL);
+    if (!ef)
+        return -ENOMEM;
 
-    eeprom->users++;
-    /* store a pointer to struct eep_dev here for other methods */
-    filp->private_data = eeprom;
-    mutex_unlock(&device_list_lock);
+    ef->eeprom = eeprom;
+    /* store a pointer to struct eep_file here for other methods */
+    filp->private_data = ef;
     return 0;
-
-err_alloc_data_buf:
-    kfree(eeprom->data);
-    eeprom->data = NULL;
-err_find_dev:
-    mutex_unlock(&device_list_lock);
-    return err;
 }
 
 /*
@@ -88,62 +150,105 @@ err_find_dev:
  */
 int eep_release(struct inode *inode, struct file *filp)
 {
-    struct eep_dev *eeprom;
-
-    mutex_lock(&device_list_lock);
-    eeprom = filp->private_data;
+    kfree(filp->private_data);
+    return 0;
+}
 
-    /* last close? */
-    eeprom->users--;
-    if (!eeprom->users) {
-        kfree(eeprom->data);
-        eeprom->data = NULL ; /* Never forget to set to 'NULL' after freeing */
+/*
+ * Read len bytes at addr straight from the chip. regmap splits the read
+ * into transfers the adapter accepts; it is only chunked here to honor
+ * read_chunk and the 16-bit length of an I2C message.
+ *
+ * Returns the number of bytes read, which is short only if the bus
+ * failed after some progress, or a negative error code.
+ */
+static int eep_read_chip(struct eep_dev *eeprom, unsigned int addr,
+                         unsigned char *buf, unsigned int len)
+{
+    unsigned int chunk = EEP_SIZE / 2;
+    unsigned int done = 0, n;
+    int ret;
+
+    if (read_chunk)
+        chunk = min(chunk, read_chunk);
+
+    while (done < len) {
+        n = min(chunk, len - done);
+        ret = regmap_bulk_read(eeprom->regmap, addr + done, buf + done, n);
+        if (ret < 0) {
+            pr_err("ee24lc512: regmap_bulk_read failed\n");
+            return done ? done : ret;
+        }
+        done += n;
     }
+    return done;
+}
 
-    mutex_unlock(&device_list_lock);
+/*
+ * Make sure pages first to last of the shadow hold the chip content,
+ * reading each run of missing pages in one go. Called with eep_mutex held.
+ */
+static int eep_fill(struct eep_dev *eeprom, unsigned int first,
+                    unsigned int last)
+{
+    unsigned int page = first, end;
+    int ret;
+
+    while ((page = find_next_zero_bit(eeprom->valid, last + 1, page)) <= last) {
+        end = find_next_bit(eeprom->valid, last + 1, page);
+        ret = eep_read_chip(eeprom, page * EEP_PAGE_SIZE,
+                            eeprom->shadow + page * EEP_PAGE_SIZE,
+                            (end - page) * EEP_PAGE_SIZE);
+        if (ret < 0)
+            return ret;
+        bitmap_set(eeprom->valid, page, ret / EEP_PAGE_SIZE);
+        if (ret < (end - page) * EEP_PAGE_SIZE)
+            return -EIO;
+        page = end;
+    }
     return 0;
 }
 
 ssize_t  eep_read(struct file *filp, char __user *buf,
                     size_t count, loff_t *f_pos)
 {
-    struct eep_dev *eeprom = filp->private_data;
-    struct i2c_msg msg[2];
+    struct eep_file *ef = filp->private_data;
+    struct eep_dev *eeprom = ef->eeprom;
     ssize_t retval = 0;
-    int _reg_addr;
-    u8 reg_addr[2];
 
     if (mutex_lock_killable(&eeprom->eep_mutex))
         return -EINTR;
 
-    if (*f_pos >= EEP_SIZE) /* EOF */
+    if (eeprom->gone) {
+        retval = -ENODEV;
         goto end_read;
+    }
 
-    if (*f_pos + count > EEP_SIZE)
-        count = EEP_SIZE - *f_pos;
-
-    if (count > EEP_SIZE)
-        count = EEP_SIZE;
+    if (*f_pos >= EEP_SIZE || !count) /* EOF */
+        goto end_read;
 
-    _reg_addr = (int)(*f_pos);
-    reg_addr[0] = (u8)(_reg_addr >> 8);
-    reg_addr[1] = (u8)(_reg_addr & 0xFF);
+    /* Readers see queued writes */
+    eep_apply_pending(eeprom);
 
-    msg[0].addr = eeprom->client->addr;
-    msg[0].flags = 0;                    /* Write */
-    msg[0].len = 2;                      /* Address is 2byte coded */
-    msg[0].buf = reg_addr;          
+    if (*f_pos + count > EEP_SIZE)
+        count = EEP_SIZE - *f_pos;
 
-    msg[1].addr = eeprom->client->addr;
-    msg[1].flags = I2C_M_RD;             /* We need to read */
-    msg[1].len = count; 
-    msg[1].buf = eeprom->data;
+    /* Only what has never been read before goes on the bus */
+    retval = eep_fill(eeprom, *f_pos / EEP_PAGE_SIZE,
+                      (*f_pos + count - 1) / EEP_PAGE_SIZE);
+    if (retval < 0) {
+        /* Still hand out whatever was read before the failure */
+        loff_t end = find_next_zero_bit(eeprom->valid, EEP_NR_PAGES,
+                                        *f_pos / EEP_PAGE_SIZE);
+
+        end *= EEP_PAGE_SIZE;
+        if (end <= *f_pos)
+            goto end_read;
+        count = min_t(loff_t, count, end - *f_pos);
+    }
 
-    if (i2c_transfer(eeprom->client->adapter, msg, 2) < 0)
-        pr_err("ee24lc512: i2c_transfer failed\n"); 
- 
-    if (copy_to_user(buf, eeprom->data, count) != 0) {
-        retval = -EIO;
+    if (copy_to_user(buf, eeprom->shadow + *f_pos, count) != 0) {
+        retval = -EFAULT;
         goto end_read;
     }
 
@@ -155,106 +260,429 @@ end_read:
     return retval;
 }
 
+/*
+ * Program len bytes of data, starting at offset, at _reg_addr. The range
+ * must not cross a page boundary: the chip would wrap around within the
+ * page. data must be DMA-safe; called with eep_mutex held, which also
+ * protects wbuf.
+ *
+ * Adapters supporting I2C_M_NOSTART get the address and the data as two
+ * messages merged into a single write, so the data goes on the bus right
+ * from the shadow. Others get both assembled in the bounce buffer. Either
+ * way nothing is allocated nor placed on the stack per page.
+ */
 int transacWrite(struct eep_dev *eeprom,
         int _reg_addr, unsigned char *data,
         int offset, unsigned int len)
 {
-    unsigned char tmp[len + 2];
-    struct i2c_msg msg[1];
-
-    tmp[0] =  (u8)(_reg_addr >> 8);
-    tmp[1] =  (u8)(_reg_addr & 0xFF);
-    memcpy (tmp + 2, &(data[offset]), len);
-
-    msg[0].addr = eeprom->client->addr;
-    msg[0].flags = 0;                    /* Write */
-    msg[0].len = len + 2; /* Address is 2 bytes coded */
-    msg[0].buf = tmp;
-
-    if (i2c_transfer(eeprom->client->adapter, msg, 1) < 0){
-        pr_err("ee24lc512: i2c_transfer failed\n");  
-        return -1;
-     }
-     return len;
+    struct i2c_client *client = eeprom->client;
+    struct i2c_msg msg[2];
+    int nmsgs = 1;
+
+    eeprom->wbuf[0] = (u8)(_reg_addr >> 8);
+    eeprom->wbuf[1] = (u8)(_reg_addr & 0xFF);
+
+    msg[0].addr = client->addr;
+    msg[0].flags = I2C_M_DMA_SAFE;       /* Write */
+    msg[0].buf = eeprom->wbuf;
+
+    if (i2c_check_functionality(client->adapter, I2C_FUNC_NOSTART)) {
+        msg[0].len = 2;                  /* Address is 2 bytes coded */
+        msg[1].addr = client->addr;
+        msg[1].flags = I2C_M_NOSTART | I2C_M_DMA_SAFE;
+        msg[1].len = len;
+        msg[1].buf = &data[offset];
+        nmsgs = 2;
+    } else {
+        memcpy(eeprom->wbuf + 2, &data[offset], len);
+        msg[0].len = len + 2;
+    }
+
+    if (i2c_transfer(client->adapter, msg, nmsgs) != nmsgs) {
+        pr_err("ee24lc512: i2c_transfer failed\n");
+        return -EIO;
+    }
+    return len;
+}
+
+/*
+ * Wait for the end of the internal write cycle. While programming, the
+ * chip does not acknowledge its address, so keep probing it with empty
+ * writes until it does (ACK polling), sleeping between attempts with an
+ * increasing back-off. This returns as soon as the chip is ready, which
+ * is typically well under the 5ms worst case. regmap cannot send empty
+ * messages, hence the raw I2C transfer.
+ */
+static int eep_wait_ready(struct eep_dev *eeprom)
+{
+    struct i2c_client *client = eeprom->client;
+    unsigned long timeout = jiffies + msecs_to_jiffies(EEP_WRITE_TIMEOUT_MS);
+    unsigned int delay_us = 100;
+    u8 reg_addr[2] = { 0, 0 };
+    struct i2c_msg msg;
+    bool expired;
+
+    msg.addr = client->addr;
+    msg.flags = 0;                       /* Write */
+    msg.len = 0;                         /* Nothing but the address byte */
+    msg.buf = reg_addr;
+
+    /*
+     * Adapters unable to issue zero-length writes get an address-only
+     * write instead: it just sets the address pointer, no write cycle.
+     */
+    if (i2c_check_quirks(client->adapter, I2C_AQ_NO_ZERO_LEN_WRITE))
+        msg.len = 2;
+
+    do {
+        /* Always give the chip a last chance after the timeout */
+        expired = time_after(jiffies, timeout);
+        if (i2c_transfer(client->adapter, &msg, 1) == 1)
+            return 0;
+
+        usleep_range(delay_us, delay_us * 2);
+        delay_us = min(delay_us * 2, 1000U);
+    } while (!expired);
+
+    dev_err(&client->dev, "write cycle timeout\n");
+    return -ETIMEDOUT;
+}
+
+/*
+ * Program the modified part of a dirty page from the shadow and clear its
+ * dirty bit. Called with eep_mutex held; on failure the page stays dirty
+ * to be retried.
+ */
+static int eep_writeback_page(struct eep_dev *eeprom, unsigned int page)
+{
+    unsigned int addr = page * EEP_PAGE_SIZE + eeprom->dirty_lo[page];
+    unsigned int len = eeprom->dirty_hi[page] - eeprom->dirty_lo[page] + 1;
+    int ret;
+
+    ret = transacWrite(eeprom, addr, eeprom->shadow, addr, len);
+    if (ret < 0)
+        return ret;
+    ret = eep_wait_ready(eeprom);
+    if (ret < 0)
+        return ret;
+
+    clear_bit(page, eeprom->dirty);
+    eeprom->pages_written++;
+    eeprom->bytes_programmed += len;
+    return 0;
+}
+
+/* Write all the dirty pages back, called with eep_mutex held */
+static int eep_sync(struct eep_dev *eeprom)
+{
+    unsigned int page;
+    int ret;
+
+    for_each_set_bit(page, eeprom->dirty, EEP_NR_PAGES) {
+        ret = eep_writeback_page(eeprom, page);
+        if (ret < 0)
+            return ret;
+    }
+    return 0;
+}
+
+/*
+ * Background writeback. The lock is dropped between pages, so readers
+ * and writers only ever wait for a single page program cycle.
+ */
+static void eep_writeback_work(struct work_struct *work)
+{
+    struct eep_dev *eeprom = container_of(to_delayed_work(work),
+                                          struct eep_dev, writeback);
+    unsigned int page;
+    int ret;
+
+    for (;;) {
+        mutex_lock(&eeprom->eep_mutex);
+        page = find_first_bit(eeprom->dirty, EEP_NR_PAGES);
+        if (page >= EEP_NR_PAGES) {
+            mutex_unlock(&eeprom->eep_mutex);
+            break;
+        }
+        ret = eep_writeback_page(eeprom, page);
+        mutex_unlock(&eeprom->eep_mutex);
+        if (ret < 0) {
+            /* Left dirty: the next write or fsync() will try again */
+            dev_err(&eeprom->client->dev, "writeback of page %u failed: %d\n",
+                    page, ret);
+            break;
+        }
+    }
+}
+
+/*
+ * Copy len bytes into the shadow at pos, within a single page. Each write
+ * cycle wears the cells out, so data is first compared with the page
+ * content: a page is only marked dirty if something changes, and only the
+ * changed range, from the first to the last modified byte, gets
+ * programmed. Called with eep_mutex held.
+ */
+static int eep_store(struct eep_dev *eeprom, unsigned int pos,
+                     const void *data, unsigned int len)
+{
+    unsigned int page = pos / EEP_PAGE_SIZE;
+    unsigned char *dst = eeprom->shadow + pos;
+    const unsigned char *src = data;
+    unsigned int first, last, lo, hi;
+    int ret;
+
+    /* Reading a page costs less than programming it for nothing */
+    ret = eep_fill(eeprom, page, page);
+    if (ret < 0)
+        return ret;
+
+    for (first = 0; first < len && dst[first] == src[first]; first++)
+        ;
+    if (first == len) {
+        eeprom->pages_skipped++;
+        return 0;
+    }
+    for (last = len - 1; dst[last] == src[last]; last--)
+        ;
+    memcpy(dst + first, src + first, last - first + 1);
+
+    lo = pos % EEP_PAGE_SIZE + first;
+    hi = pos % EEP_PAGE_SIZE + last;
+    if (test_and_set_bit(page, eeprom->dirty)) {
+        lo = min_t(unsigned int, lo, eeprom->dirty_lo[page]);
+        hi = max_t(unsigned int, hi, eeprom->dirty_hi[page]);
+    }
+    eeprom->dirty_lo[page] = lo;
+    eeprom->dirty_hi[page] = hi;
+    return 0;
+}
+
+/*
+ * Move the writes queued by async files to the shadow, in order, and have
+ * them written back. Called with eep_mutex held.
+ */
+static void eep_apply_pending(struct eep_dev *eeprom)
+{
+    struct eep_pending *p, *tmp;
+    unsigned int off, len;
+    LIST_HEAD(list);
+    int ret;
+
+    mutex_lock(&eeprom->pending_lock);
+    list_splice_init(&eeprom->pending, &list);
+    eeprom->pending_bytes = 0;
+    mutex_unlock(&eeprom->pending_lock);
+
+    if (list_empty(&list))
+        return;
+
+    list_for_each_entry_safe(p, tmp, &list, node) {
+        for (off = 0; off < p->len; off += len) {
+            len = min_t(unsigned int, p->len - off,
+                        EEP_PAGE_SIZE - (p->pos + off) % EEP_PAGE_SIZE);
+            ret = eep_store(eeprom, p->pos + off, p->data + off, len);
+            if (ret < 0 && !eeprom->async_err) {
+                dev_err(&eeprom->client->dev, "queued write at 0x%04x failed: %d\n",
+                        p->pos + off, ret);
+                eeprom->async_err = ret;
+            }
+        }
+        list_del(&p->node);
+        kfree(p);
+    }
+
+    queue_delayed_work(eeprom->wq, &eeprom->writeback,
+                       msecs_to_jiffies(writeback_ms));
+}
+
+static void eep_apply_work(struct work_struct *work)
+{
+    struct eep_dev *eeprom = container_of(work, struct eep_dev, apply);
+
+    mutex_lock(&eeprom->eep_mutex);
+    eep_apply_pending(eeprom);
+    mutex_unlock(&eeprom->eep_mutex);
 }
 
+/*
+ * Async mode write: queue a copy of the data and return without waiting
+ * for the device lock, hence for any bus activity. Past EEP_SIZE bytes
+ * queued, writers wait for the queue to drain.
+ */
+static ssize_t eep_write_async(struct eep_dev *eeprom, const char __user *buf,
+                               size_t count, loff_t *f_pos)
+{
+    struct eep_pending *p;
+    bool throttle;
+
+    if (*f_pos >= EEP_SIZE)
+        return -EINVAL;
+    if (*f_pos + count > EEP_SIZE)
+        count = EEP_SIZE - *f_pos;
+    if (!count)
+        return 0;
+
+    p = kmalloc(struct_size(p, data, count), GFP_KERNEL);
+    if (!p)
+        return -ENOMEM;
+    if (copy_from_user(p->data, buf, count) != 0) {
+        kfree(p);
+        return -EFAULT;
+    }
+    p->pos = *f_pos;
+    p->len = count;
+
+    mutex_lock(&eeprom->pending_lock);
+    if (eeprom->gone) {
+        mutex_unlock(&eeprom->pending_lock);
+        kfree(p);
+        return -ENODEV;
+    }
+    list_add_tail(&p->node, &eeprom->pending);
+    eeprom->pending_bytes += count;
+    throttle = eeprom->pending_bytes > EEP_SIZE;
+    /* Not gone yet: remove() has not torn the workqueue down */
+    queue_work(eeprom->wq, &eeprom->apply);
+    mutex_unlock(&eeprom->pending_lock);
+
+    /*
+     * Drain the queue ourselves rather than flush the work, which could
+     * race with remove() destroying the workqueue.
+     */
+    if (throttle) {
+        mutex_lock(&eeprom->eep_mutex);
+        if (!eeprom->gone)
+            eep_apply_pending(eeprom);
+        mutex_unlock(&eeprom->eep_mutex);
+    }
+
+    *f_pos += count;
+    return count;
+}
+
+/*
+ * Writes only land in the shadow and mark the pages they modify dirty,
+ * the writeback work then programs each dirty page in a single page
+ * write, however many write() calls modified it. Files opened with
+ * O_SYNC or O_DSYNC write back before returning.
+ */
 ssize_t  eep_write(struct file *filp, const char __user *buf,
                     size_t count,  loff_t *f_pos)
 {
-    int i, _reg_addr, offset, remain_in_page, nb_page, last_remain;
-    struct eep_dev *eeprom = filp->private_data;
+    struct eep_file *ef = filp->private_data;
+    struct eep_dev *eeprom = ef->eeprom;
+    unsigned char tmp[EEP_PAGE_SIZE];
+    unsigned int offset, len;
+    loff_t pos = *f_pos;
+    size_t done = 0;
     ssize_t retval = 0;
 
+    if (ef->async)
+        return eep_write_async(eeprom, buf, count, f_pos);
+
     if (mutex_lock_killable(&eeprom->eep_mutex))
         return -EINTR;
 
-    if (*f_pos >= EEP_SIZE) {
-        retval = -EINVAL;
+    if (eeprom->gone) {
+        retval = -ENODEV;
         goto end_write;
     }
 
-    if (*f_pos >= EEP_SIZE) {
+    /* Queued writes are older, they must not overwrite this one */
+    eep_apply_pending(eeprom);
+
+    if (pos >= EEP_SIZE) {
         /* Writing beyond the end of the buffer is not allowed. */
         retval = -EINVAL;
         goto end_write;
     }
 
-    if (*f_pos + count > EEP_SIZE)
-        count = EEP_SIZE - *f_pos;
-
-    if (count > EEP_SIZE)
-        count = EEP_SIZE;
+    if (pos + count > EEP_SIZE)
+        count = EEP_SIZE - pos;
 
-    if (copy_from_user(eeprom->data, buf, count) != 0) {
-        retval = -EFAULT;
-        goto end_write;
+    /* Read in what is to be compared in one go, not page by page */
+    if (count) {
+        retval = eep_fill(eeprom, pos / EEP_PAGE_SIZE,
+                          (pos + count - 1) / EEP_PAGE_SIZE);
+        if (retval < 0)
+            goto end_write;
     }
 
-    _reg_addr =  (int)(*f_pos);
-    offset = 0;
-    remain_in_page = (EEP_PAGE_SIZE - (_reg_addr % EEP_PAGE_SIZE)) % EEP_PAGE_SIZE;
-    nb_page = (count - remain_in_page) / EEP_PAGE_SIZE;
-    last_remain = (count - remain_in_page) % EEP_PAGE_SIZE ;
+    while (done < count) {
+        offset = pos % EEP_PAGE_SIZE;
+        len = min_t(size_t, count - done, EEP_PAGE_SIZE - offset);
 
-    if (remain_in_page > 0){
-        retval = transacWrite(eeprom, _reg_addr, eeprom->data, offset, remain_in_page);
-        if (retval < 0)
-            goto end_write;
-        offset += remain_in_page;
-        _reg_addr += remain_in_page;
-        retval = offset;
-        mdelay(10);
-    }
-
-    if (nb_page) {
-        for (i=0; i < nb_page; i++){
-            retval = transacWrite(eeprom, _reg_addr, eeprom->data, offset, EEP_PAGE_SIZE);
-            if (retval < 0)
-                goto end_write;
-            offset += EEP_PAGE_SIZE;
-            _reg_addr += EEP_PAGE_SIZE;
-            retval = offset;
-            mdelay(10);
+        if (copy_from_user(tmp, buf + done, len) != 0) {
+            retval = -EFAULT;
+            break;
         }
-    }
 
-    if (last_remain > 0){
-        retval = transacWrite(eeprom, _reg_addr, eeprom->data, offset, last_remain);
+        retval = eep_store(eeprom, pos, tmp, len);
         if (retval < 0)
-            goto end_write;
-        offset += last_remain;
-        _reg_addr += last_remain;
-        retval = offset;
-        mdelay(10);
+            break;
+        done += len;
+        pos += len;
     }
 
-    *f_pos += count;
+    if (!done)
+        goto end_write;
+
+    *f_pos = pos;
+    retval = done;
+    if (filp->f_flags & O_DSYNC) {
+        int err = eep_sync(eeprom);
+
+        if (err < 0)
+            retval = err;
+    } else {
+        queue_delayed_work(eeprom->wq, &eeprom->writeback,
+                           msecs_to_jiffies(writeback_ms));
+    }
 
 end_write:
     mutex_unlock(&eeprom->eep_mutex);
     return retval;
 }
 
+int eep_fsync(struct file *filp, loff_t start, loff_t end, int datasync)
+{
+    struct eep_file *ef = filp->private_data;
+    struct eep_dev *eeprom = ef->eeprom;
+    int ret;
+
+    if (mutex_lock_killable(&eeprom->eep_mutex))
+        return -EINTR;
+    if (eeprom->gone) {
+        mutex_unlock(&eeprom->eep_mutex);
+        return -ENODEV;
+    }
+    eep_apply_pending(eeprom);
+    ret = eep_sync(eeprom);
+    if (!ret) {
+        ret = eeprom->async_err;
+        eeprom->async_err = 0;
+    }
+    mutex_unlock(&eeprom->eep_mutex);
+    return ret;
+}
+
+long eep_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    struct eep_file *ef = filp->private_data;
+
+    switch (cmd) {
+    case EEP_IOC_SET_ASYNC:
+        ef->async = !!arg;
+        return 0;
+
+    case EEP_IOC_SYNC:
+        return eep_fsync(filp, 0, EEP_SIZE - 1, 0);
+
+    default:
+        return -ENOTTY;
+    }
+}
+
 loff_t eep_llseek(struct file *filp, loff_t off, int whence)
 {
     loff_t newpos = 0;
@@ -281,6 +709,98 @@ loff_t eep_llseek(struct file *filp, loff_t off, int whence)
     return newpos;
 }
 
+static ssize_t pages_written_show(struct device *dev,
+                                  struct device_attribute *attr, char *buf)
+{
+    struct eep_dev *eeprom = container_of(dev, struct eep_dev, dev);
+
+    return sprintf(buf, "%lu\n", READ_ONCE(eeprom->pages_written));
+}
+static DEVICE_ATTR_RO(pages_written);
+
+static ssize_t pages_skipped_show(struct device *dev,
+                                  struct device_attribute *attr, char *buf)
+{
+    struct eep_dev *eeprom = container_of(dev, struct eep_dev, dev);
+
+    return sprintf(buf, "%lu\n", READ_ONCE(eeprom->pages_skipped));
+}
+static DEVICE_ATTR_RO(pages_skipped);
+
+static ssize_t bytes_programmed_show(struct device *dev,
+                                     struct device_attribute *attr, char *buf)
+{
+    struct eep_dev *eeprom = container_of(dev, struct eep_dev, dev);
+
+    return sprintf(buf, "%lu\n", READ_ONCE(eeprom->bytes_programmed));
+}
+static DEVICE_ATTR_RO(bytes_programmed);
+
+static struct attribute *eep_attrs[] = {
+    &dev_attr_pages_written.attr,
+    &dev_attr_pages_skipped.attr,
+    &dev_attr_bytes_programmed.attr,
+    NULL,
+};
+ATTRIBUTE_GROUPS(eep);
+
+/*
+ * nvmem accessors, for in-kernel consumers (MAC addresses, calibration
+ * cells...) and the sysfs nvmem file. They share the shadow with the char
+ * device. There is no fsync() for these users, so writes are programmed
+ * before returning.
+ */
+static int eep_nvmem_read(void *priv, unsigned int off, void *val,
+                          size_t count)
+{
+    struct eep_dev *eeprom = priv;
+    int ret;
+
+    if (!count)
+        return 0;
+
+    mutex_lock(&eeprom->eep_mutex);
+    if (eeprom->gone) {
+        mutex_unlock(&eeprom->eep_mutex);
+        return -ENODEV;
+    }
+    eep_apply_pending(eeprom);
+    ret = eep_fill(eeprom, off / EEP_PAGE_SIZE,
+                   (off + count - 1) / EEP_PAGE_SIZE);
+    if (!ret)
+        memcpy(val, eeprom->shadow + off, count);
+    mutex_unlock(&eeprom->eep_mutex);
+    return ret;
+}
+
+static int eep_nvmem_write(void *priv, unsigned int off, void *val,
+                           size_t count)
+{
+    struct eep_dev *eeprom = priv;
+    unsigned int len;
+    int ret = 0;
+
+    mutex_lock(&eeprom->eep_mutex);
+    if (eeprom->gone) {
+        mutex_unlock(&eeprom->eep_mutex);
+        return -ENODEV;
+    }
+    eep_apply_pending(eeprom);
+    while (count) {
+        len = min_t(size_t, count, EEP_PAGE_SIZE - off % EEP_PAGE_SIZE);
+        ret = eep_store(eeprom, off, val, len);
+        if (ret < 0)
+            break;
+        off += len;
+        val += len;
+        count -= len;
+    }
+    if (!ret)
+        ret = eep_sync(eeprom);
+    mutex_unlock(&eeprom->eep_mutex);
+    return ret;
+}
+
 struct file_operations eep_fops = {
 	.owner =    THIS_MODULE,
 	.read =     eep_read,
@@ -288,6 +808,9 @@ struct file_operations eep_fops = {
 	.open =     eep_open,
 	.release =  eep_release,
 	.llseek =   eep_llseek,
+	.fsync =    eep_fsync,
+	.unlocked_ioctl = eep_ioctl,
+	.compat_ioctl = compat_ptr_ioctl,
 };
 
 #ifdef CONFIG_OF
@@ -298,82 +821,138 @@ static const struct of_device_id eeprom_dt_ids[] = {
 MODULE_DEVICE_TABLE(of, eeprom_dt_ids);
 #endif
 
+static void eep_destroy_wq(void *wq)
+{
+    destroy_workqueue(wq);
+}
+
+/* Called once the chip is unbound and the last file on it closed */
+static void eep_dev_release(struct device *dev)
+{
+    struct eep_dev *eeprom = container_of(dev, struct eep_dev, dev);
+
+    ida_free(&eep_minors, eeprom->minor);
+    kfree(eeprom);
+}
+
 static int ee24lc512_probe(struct i2c_client *client,
 			    const struct i2c_device_id *id)
 {
-    int major;
-    unsigned char data[5];
-    u8 reg_addr[2];
-    struct i2c_msg msg[2];
-
+    int minor;
     int err = 0;
     struct eep_dev *eeprom = NULL;
-    struct device *device = NULL;
 
-    if (!i2c_check_functionality(client->adapter,
-            I2C_FUNC_SMBUS_BYTE_DATA))
+    if (!i2c_check_functionality(client->adapter, I2C_FUNC_I2C))
         return -EIO;
 
-   /* 
-    * We send a simple i2c transaction. If it fails,
-    * it means there is no eeprom
-    */
-    reg_addr[0] =  0x00;
-    reg_addr[1] =  0x00;
-
-    msg[0].addr = client->addr;
-    msg[0].flags = 0;                    /* Write */
-    msg[0].len = 2;                      /* Address is 2byte coded */
-    msg[0].buf = reg_addr;          
-
-    msg[1].addr = client->addr;
-    msg[1].flags = I2C_M_RD;             /* We need to read */
-    msg[1].len = 5; //count; 
-    msg[1].buf = data;
-
-    if (i2c_transfer(client->adapter, msg, 2) < 0) {
-        pr_err("ee24lc512: i2c_transfer failed\n");
-        return -ENODEV;
-    }
+    minor = ida_alloc_max(&eep_minors, EEP_MINORS - 1, GFP_KERNEL);
+    if (minor < 0)
+        return minor;
 
-    eeprom = devm_kzalloc(&client->dev, sizeof(*eeprom), GFP_KERNEL);
-    if (!eeprom)
+    /*
+     * Not a devm allocation: open files may outlive the binding, the
+     * structure is freed by eep_dev_release() on the last put_device().
+     */
+    eeprom = kzalloc(sizeof(*eeprom), GFP_KERNEL);
+    if (!eeprom) {
+        ida_free(&eep_minors, minor);
         return -ENOMEM;
-
-    major = register_chrdev(0, "eeprom", &eep_fops);
-    if (major < 0) {
-        pr_err("[target] register_chrdev() failed\n");
-        return major;
     }
 
     /* Construct devices */
-    eeprom->data = NULL;
+    eeprom->minor = minor;
     eeprom->client = client;
     mutex_init(&eeprom->eep_mutex);
-    INIT_LIST_HEAD(&eeprom->device_entry);
+    INIT_DELAYED_WORK(&eeprom->writeback, eep_writeback_work);
+    INIT_LIST_HEAD(&eeprom->pending);
+    mutex_init(&eeprom->pending_lock);
+    INIT_WORK(&eeprom->apply, eep_apply_work);
+    device_initialize(&eeprom->dev);
+    eeprom->dev.class = eep_class;
+    eeprom->dev.parent = &client->dev;
+    eeprom->dev.devt = MKDEV(MAJOR(eep_devt), minor);
+    eeprom->dev.release = eep_dev_release;
+    eeprom->dev.groups = eep_groups;
+
+    /* The rest only lives as long as the chip is bound */
+    eeprom->shadow = devm_kzalloc(&client->dev, EEP_SIZE, GFP_KERNEL);
+    eeprom->wbuf = devm_kmalloc(&client->dev, EEP_PAGE_SIZE + 2, GFP_KERNEL);
+    if (!eeprom->shadow || !eeprom->wbuf) {
+        err = -ENOMEM;
+        goto fail;
+    }
+
+    eeprom->regmap = devm_regmap_init_i2c(client, &eep_regmap_config);
+    if (IS_ERR(eeprom->regmap)) {
+        err = PTR_ERR(eeprom->regmap);
+        goto fail;
+    }
 
-    eeprom->devt = MKDEV(major, 0);
-    device = device_create(eep_class, NULL, /* no parent device */
-        eeprom->devt, NULL, /* no additional data */
-        EEP_DEVICE_NAME "_%d", probed_ndevices++);
+    eeprom->wq = alloc_ordered_workqueue("%s", WQ_MEM_RECLAIM,
+                                         dev_name(&client->dev));
+    if (!eeprom->wq) {
+        err = -ENOMEM;
+        goto fail;
+    }
+    err = devm_add_action_or_reset(&client->dev, eep_destroy_wq, eeprom->wq);
+    if (err)
+        goto fail;
 
-    if (IS_ERR(device)) {
-        err = PTR_ERR(device);
-        pr_err("[target] Error %d while trying to create %s%d",
-                err, EEP_DEVICE_NAME, --probed_ndevices);
+    /*
+     * Read the first page in. If it fails, it means there is no
+     * eeprom, otherwise the page is cached for later.
+     */
+    if (eep_fill(eeprom, 0, 0) < 0) {
+        err = -ENODEV;
         goto fail;
     }
 
-    mutex_lock(&device_list_lock);
-    list_add(&eeprom->device_entry, &device_list);
-    i2c_set_clientdata(client, eeprom);
-    mutex_unlock(&device_list_lock);
+    eeprom->nvmem_config.type = NVMEM_TYPE_EEPROM;
+    eeprom->nvmem_config.name = dev_name(&client->dev);
+    eeprom->nvmem_config.dev = &client->dev;
+    eeprom->nvmem_config.root_only = true;
+    eeprom->nvmem_config.owner = THIS_MODULE;
+    eeprom->nvmem_config.reg_read = eep_nvmem_read;
+    eeprom->nvmem_config.reg_write = eep_nvmem_write;
+    eeprom->nvmem_config.priv = eeprom;
+    eeprom->nvmem_config.stride = 1;
+    eeprom->nvmem_config.word_size = 1;
+    eeprom->nvmem_config.size = EEP_SIZE;
+
+    /*
+     * Not devm either: the accessors use eeprom, which remove() may free,
+     * so the provider has to be gone before that.
+     */
+    eeprom->nvmem = nvmem_register(&eeprom->nvmem_config);
+    if (IS_ERR(eeprom->nvmem)) {
+        err = PTR_ERR(eeprom->nvmem);
+        /* CONFIG_NVMEM=n: the char device works without a provider */
+        if (err != -EOPNOTSUPP)
+            goto fail;
+        eeprom->nvmem = NULL;
+        err = 0;
+    }
+
+    err = dev_set_name(&eeprom->dev, EEP_DEVICE_NAME "_%d", minor);
+    if (err)
+        goto fail_nvmem;
+
+    cdev_init(&eeprom->cdev, &eep_fops);
+    eeprom->cdev.owner = THIS_MODULE;
+    err = cdev_device_add(&eeprom->cdev, &eeprom->dev);
+    if (err) {
+        pr_err("[target] Error %d while trying to create %s_%d",
+                err, EEP_DEVICE_NAME, minor);
+        goto fail_nvmem;
+    }
 
+    i2c_set_clientdata(client, eeprom);
     return 0; /* success */
 
+fail_nvmem:
+    nvmem_unregister(eeprom->nvmem);
 fail:
-    if (eeprom)
-        kfree(eeprom);
+    put_device(&eeprom->dev);
     return err;
 }
 
@@ -381,14 +960,31 @@ static int ee24lc512_remove(struct i2c_client *client)
 {
     struct eep_dev *eeprom = i2c_get_clientdata(client);
 
+    /*
+     * Removes the nvmem sysfs file, waiting for its readers, while
+     * eeprom is still there for the accessors.
+     */
+    nvmem_unregister(eeprom->nvmem);
+
     /* prevent new opens */
-    mutex_lock(&device_list_lock);
-    list_del(&eeprom->device_entry);
-    device_destroy(eep_class, eeprom->devt);
-    if (eeprom->users == 0)
-        kfree(eeprom);
-    mutex_unlock(&device_list_lock);
+    cdev_device_del(&eeprom->cdev, &eeprom->dev);
 
+    /*
+     * Files still open get -ENODEV from now on. Do not lose what is
+     * still queued or sitting in the shadow.
+     */
+    mutex_lock(&eeprom->eep_mutex);
+    mutex_lock(&eeprom->pending_lock);
+    eeprom->gone = true;
+    mutex_unlock(&eeprom->pending_lock);
+    eep_apply_pending(eeprom);
+    if (eep_sync(eeprom) < 0)
+        dev_err(&client->dev, "dirty pages lost on removal\n");
+    mutex_unlock(&eeprom->eep_mutex);
+    cancel_work_sync(&eeprom->apply);
+    cancel_delayed_work_sync(&eeprom->writeback);
+
+    put_device(&eeprom->dev);
     return 0;
 }
 
@@ -417,13 +1013,21 @@ static int __init eeprom_drv_init(void)
      * that will key udev/mdev to add/remove /dev nodes.  Last, register
      * the driver which manages those device numbers.
      */
+    status = alloc_chrdev_region(&eep_devt, 0, EEP_MINORS, "eeprom");
+    if (status < 0)
+        return status;
+
     eep_class = class_create(THIS_MODULE, "eeprom");
-    if (IS_ERR(eep_class))
+    if (IS_ERR(eep_class)) {
+        unregister_chrdev_region(eep_devt, EEP_MINORS);
         return PTR_ERR(eep_class);
+    }
 
     status = i2c_register_driver(THIS_MODULE, &ee24lc512_i2c_driver);
-    if (status < 0)
+    if (status < 0) {
         class_destroy(eep_class);
+        unregister_chrdev_region(eep_devt, EEP_MINORS);
+    }
 
     return status;
 }
@@ -433,6 +1037,7 @@ static void __exit eeprom_drv_exit(void)
 {
     i2c_del_driver(&ee24lc512_i2c_driver);
     class_destroy(eep_class);
+    unregister_chrdev_region(eep_devt, EEP_MINORS);
 }
 module_exit(eeprom_drv_exit);
 
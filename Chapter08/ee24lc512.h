@@ -0,0 +1,25 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Userspace interface of the ee24lc512 char device.
+ */
+#ifndef __EE24LC512_H
+#define __EE24LC512_H
+
+#include <linux/ioctl.h>
+
+#define EEP_IOC_MAGIC       'e'
+/*
+ * Select the write mode of this open file, the argument being a value,
+ * not a pointer. In async mode (1), write() queues the data and returns
+ * without touching the bus; the data is visible to readers right away
+ * and programmed in the background. The default (0) updates the driver
+ * copy of the chip before returning.
+ */
+#define EEP_IOC_SET_ASYNC   _IO(EEP_IOC_MAGIC, 0)
+/*
+ * Wait until everything written so far, by any file, is programmed into
+ * the chip, like fsync(). Returns the first error of background writes.
+ */
+#define EEP_IOC_SYNC        _IO(EEP_IOC_MAGIC, 1)
+
+#endif /* __EE24LC512_H */
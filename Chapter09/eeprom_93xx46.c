@@ -5,9 +5,13 @@
  * (C) 2011 DENX Software Engineering, Anatolij Gustschin <agust@denx.de>
  */
 
+#include <linux/completion.h>
 #include <linux/delay.h>
 #include <linux/device.h>
 #include <linux/gpio/consumer.h>
+#include <linux/hrtimer.h>
+#include <linux/jiffies.h>
+#include <linux/log2.h>
 #include <linux/kernel.h>
 #include <linux/module.h>
 #include <linux/mutex.h>
@@ -22,17 +26,92 @@
 #define OP_START	0x4
 #define OP_WRITE	(OP_START | 0x1)
 #define OP_READ		(OP_START | 0x2)
+/* Addresses of the special instructions, on a 6-bit address */
 #define ADDR_EWDS	0x00
 #define ADDR_ERAL	0x20
 #define ADDR_EWEN	0x30
 
+/* Sizes of the family, from the 93xx46 to the 93xx86 */
+#define EEPROM_93XX46_MIN_SIZE		128
+#define EEPROM_93XX46_MAX_SIZE		2048
+
+/* Longest program or erase cycle (Twc, Tec), with some margin */
+#define EEPROM_93XX46_TIMEOUT_MS	25
+/* Word reads chained in a single message on single word read parts */
+#define EEPROM_93XX46_READ_WORDS	32
+
+static bool shadow;
+module_param(shadow, bool, 0444);
+MODULE_PARM_DESC(shadow, "serve reads from a copy of the whole device (default 0)");
+
 struct eeprom_93xx46_devtype_data {
 	unsigned int quirks;
+	unsigned int size;
 };
 
 static const struct eeprom_93xx46_devtype_data atmel_at93c46d_data = {
 	.quirks = EEPROM_93XX46_QUIRK_SINGLE_WORD_READ |
 		  EEPROM_93XX46_QUIRK_INSTRUCTION_LENGTH,
+	.size = 128,
+};
+
+static const struct eeprom_93xx46_devtype_data microchip_93lc46b_data = {
+	.size = 128,
+};
+
+static const struct eeprom_93xx46_devtype_data microchip_93lc56b_data = {
+	.size = 256,
+};
+
+static const struct eeprom_93xx46_devtype_data microchip_93lc66b_data = {
+	.size = 512,
+};
+
+static const struct eeprom_93xx46_devtype_data microchip_93lc76b_data = {
+	.size = 1024,
+};
+
+static const struct eeprom_93xx46_devtype_data microchip_93lc86b_data = {
+	.size = 2048,
+};
+
+enum eeprom_93xx46_batch_state {
+	EE_BATCH_EWEN,
+	EE_BATCH_WRITE,
+	EE_BATCH_POLL,
+};
+
+/*
+ * Bulk write, run as a chain of messages each submitted with spi_async()
+ * from the completion of the previous one: EWEN, then for each word WRITE
+ * and POLL until ready. The messages are set up once at probe. EWDS is
+ * sent synchronously by eeprom_93xx46_write() once the chain is over.
+ *
+ * spi_async() fails with -EBUSY while another device holds the bus lock:
+ * the chain then stops where it was (bus_locked) and the writer finishes
+ * the batch with spi_sync(), which waits for the lock.
+ */
+struct eeprom_93xx46_batch {
+	struct spi_message ewen_msg, write_msg, poll_msg;
+	struct spi_transfer ewen_xfer, write_xfers[2], poll_xfer;
+
+	/* DMA buffers, in their own cache lines */
+	struct {
+		u16 ewen_cmd, write_cmd, data;
+		u8 status;
+	} ____cacheline_aligned dma;
+
+	struct hrtimer poll_timer;
+	unsigned long timeout;
+	bool expired;
+
+	enum eeprom_93xx46_batch_state state;
+	const char *buf;
+	unsigned int off;
+	size_t count, pos;
+	int err;
+	bool bus_locked;
+	struct completion done;
 };
 
 struct eeprom_93xx46_dev {
@@ -43,6 +122,27 @@ struct eeprom_93xx46_dev {
 	struct nvmem_device *nvmem;
 	int addrlen;
 	int size;
+
+	/* Single word read chain, see eeprom_93xx46_read_words() */
+	struct spi_transfer *rd_xfers;
+	u16 *rd_cmds;
+
+	/*
+	 * Copy of the whole device, if the shadow parameter is set, read on
+	 * first access and kept up to date by writes and erase. Protected by
+	 * lock.
+	 */
+	u8 *shadow;
+	bool shadow_valid;
+
+	struct eeprom_93xx46_batch batch;
+
+	/*
+	 * DMA buffers, in their own cache lines at the end of the structure,
+	 * away from the fields used while a transfer is in flight.
+	 */
+	u8 status ____cacheline_aligned;	/* eeprom_93xx46_wait_ready() */
+	u16 rd_tail ____cacheline_aligned;	/* eeprom_93xx46_read_words() */
 };
 
 static inline bool has_quirk_single_word_read(struct eeprom_93xx46_dev *edev)
@@ -55,82 +155,211 @@ static inline bool has_quirk_instruction_length(struct eeprom_93xx46_dev *edev)
 	return edev->pdata->quirks & EEPROM_93XX46_QUIRK_INSTRUCTION_LENGTH;
 }
 
-static int eeprom_93xx46_read(void *priv, unsigned int off,
-			      void *val, size_t count)
+static inline int eeprom_93xx46_word_len(struct eeprom_93xx46_dev *edev)
 {
-	struct eeprom_93xx46_dev *edev = priv;
-	char *buf = val;
-	int err = 0;
+	return (edev->pdata->flags & EE_ADDR8) ? 1 : 2;
+}
 
-	if (unlikely(off >= edev->size))
-		return 0;
-	if ((off + count) > edev->size)
-		count = edev->size - off;
-	if (unlikely(!count))
-		return count;
+/*
+ * Instruction for the word at byte offset off: start bit, opcode and
+ * address, that is addrlen + 3 bits.
+ */
+static inline u16 eeprom_93xx46_cmd(struct eeprom_93xx46_dev *edev,
+				    int op, unsigned int off)
+{
+	unsigned int addr = off / eeprom_93xx46_word_len(edev);
 
-	mutex_lock(&edev->lock);
+	return (op << edev->addrlen) | (addr & ((1 << edev->addrlen) - 1));
+}
 
-	if (edev->pdata->prepare)
-		edev->pdata->prepare(edev);
+/* Special instruction (EWEN, EWDS or ERAL), *bits long */
+static u16 eeprom_93xx46_special_cmd(struct eeprom_93xx46_dev *edev,
+				     u16 addr, int *bits)
+{
+	u16 cmd_addr;
 
-	while (count) {
-		struct spi_message m;
-		struct spi_transfer t[2] = { { 0 } };
-		u16 cmd_addr = OP_READ << edev->addrlen;
-		size_t nbytes = count;
-		int bits;
-
-		if (edev->addrlen == 7) {
-			cmd_addr |= off & 0x7f;
-			bits = 10;
-			if (has_quirk_single_word_read(edev))
-				nbytes = 1;
-		} else {
-			cmd_addr |= (off >> 1) & 0x3f;
-			bits = 9;
-			if (has_quirk_single_word_read(edev))
-				nbytes = 2;
-		}
+	cmd_addr = OP_START << edev->addrlen;
+	cmd_addr |= addr << (edev->addrlen - 6);
+	*bits = edev->addrlen + 3;
+
+	if (has_quirk_instruction_length(edev)) {
+		cmd_addr <<= 2;
+		*bits += 2;
+	}
+	return cmd_addr;
+}
+
+/* Sequential read of the whole range in a single READ instruction */
+static int eeprom_93xx46_read_seq(struct eeprom_93xx46_dev *edev,
+				  unsigned int off, char *buf, size_t count)
+{
+	struct spi_message m;
+	struct spi_transfer t[2] = { { 0 } };
+	u16 cmd_addr = eeprom_93xx46_cmd(edev, OP_READ, off);
+	int ret;
 
-		dev_dbg(&edev->spi->dev, "read cmd 0x%x, %d Hz\n",
-			cmd_addr, edev->spi->max_speed_hz);
+	dev_dbg(&edev->spi->dev, "read cmd 0x%x, %d Hz\n",
+		cmd_addr, edev->spi->max_speed_hz);
 
-		spi_message_init(&m);
+	spi_message_init(&m);
+
+	t[0].tx_buf = (char *)&cmd_addr;
+	t[0].len = 2;
+	t[0].bits_per_word = edev->addrlen + 3;
+	spi_message_add_tail(&t[0], &m);
+
+	t[1].rx_buf = buf;
+	t[1].len = count;
+	t[1].bits_per_word = 8;
+	spi_message_add_tail(&t[1], &m);
 
-		t[0].tx_buf = (char *)&cmd_addr;
+	ret = spi_sync(edev->spi, &m);
+	/* have to wait at least Tcsl ns */
+	ndelay(250);
+	return ret;
+}
+
+/*
+ * Set up the transfers of the single word read chain once and for all:
+ * for each word, an instruction and a data transfer, the chip being
+ * deselected for Tcsl in between words.
+ */
+static int eeprom_93xx46_init_read_chain(struct eeprom_93xx46_dev *edev)
+{
+	struct device *dev = &edev->spi->dev;
+	int i;
+
+	edev->rd_xfers = devm_kcalloc(dev, 2 * EEPROM_93XX46_READ_WORDS,
+				      sizeof(*edev->rd_xfers), GFP_KERNEL);
+	edev->rd_cmds = devm_kcalloc(dev, EEPROM_93XX46_READ_WORDS,
+				     sizeof(*edev->rd_cmds), GFP_KERNEL);
+	if (!edev->rd_xfers || !edev->rd_cmds)
+		return -ENOMEM;
+
+	for (i = 0; i < EEPROM_93XX46_READ_WORDS; i++) {
+		struct spi_transfer *t = &edev->rd_xfers[2 * i];
+
+		t[0].tx_buf = &edev->rd_cmds[i];
 		t[0].len = 2;
-		t[0].bits_per_word = bits;
-		spi_message_add_tail(&t[0], &m);
+		t[0].bits_per_word = edev->addrlen + 3;
 
-		t[1].rx_buf = buf;
-		t[1].len = count;
+		t[1].len = eeprom_93xx46_word_len(edev);
 		t[1].bits_per_word = 8;
-		spi_message_add_tail(&t[1], &m);
+		t[1].cs_change = 1;
+		t[1].cs_change_delay.value = 250;
+		t[1].cs_change_delay.unit = SPI_DELAY_UNIT_NSECS;
+	}
+	return 0;
+}
+
+/*
+ * Read on parts without sequential read: up to EEPROM_93XX46_READ_WORDS
+ * single word reads go in each message, using the preallocated chain.
+ */
+static int eeprom_93xx46_read_words(struct eeprom_93xx46_dev *edev,
+				    unsigned int off, char *buf, size_t count)
+{
+	int word_len = eeprom_93xx46_word_len(edev);
+	struct spi_transfer *last;
+	struct spi_message m;
+	size_t len;
+	int i, n, ret;
 
-		err = spi_sync(edev->spi, &m);
+	while (count) {
+		n = min_t(size_t, DIV_ROUND_UP(count, word_len),
+			  EEPROM_93XX46_READ_WORDS);
+		len = min_t(size_t, count, n * word_len);
+
+		for (i = 0; i < n; i++) {
+			struct spi_transfer *t = &edev->rd_xfers[2 * i];
+
+			edev->rd_cmds[i] = eeprom_93xx46_cmd(edev, OP_READ,
+							     off + i * word_len);
+			/* An odd count ends in the middle of a 16-bit word */
+			if ((i + 1) * word_len > len)
+				t[1].rx_buf = &edev->rd_tail;
+			else
+				t[1].rx_buf = buf + i * word_len;
+		}
+
+		/* Leave the chip deselected after the last word */
+		last = &edev->rd_xfers[2 * n - 1];
+		last->cs_change = 0;
+		spi_message_init_with_transfers(&m, edev->rd_xfers, 2 * n);
+		ret = spi_sync(edev->spi, &m);
+		last->cs_change = 1;
 		/* have to wait at least Tcsl ns */
 		ndelay(250);
+		if (ret)
+			return ret;
 
-		if (err) {
-			dev_err(&edev->spi->dev, "read %zu bytes at %d: err. %d\n",
-				nbytes, (int)off, err);
-			break;
-		}
+		if (len % word_len)
+			memcpy(buf + len - 1, &edev->rd_tail, 1);
 
-		buf += nbytes;
-		off += nbytes;
-		count -= nbytes;
+		buf += len;
+		off += len;
+		count -= len;
 	}
+	return 0;
+}
+
+/* Read from the chip. Called with edev->lock held */
+static int eeprom_93xx46_read_chip(struct eeprom_93xx46_dev *edev,
+				   unsigned int off, char *buf, size_t count)
+{
+	int err;
+
+	if (edev->pdata->prepare)
+		edev->pdata->prepare(edev);
+
+	if (has_quirk_single_word_read(edev))
+		err = eeprom_93xx46_read_words(edev, off, buf, count);
+	else
+		err = eeprom_93xx46_read_seq(edev, off, buf, count);
+	if (err)
+		dev_err(&edev->spi->dev, "read %zu bytes at %d: err. %d\n",
+			count, (int)off, err);
 
 	if (edev->pdata->finish)
 		edev->pdata->finish(edev);
 
+	return err;
+}
+
+static int eeprom_93xx46_read(void *priv, unsigned int off,
+			      void *val, size_t count)
+{
+	struct eeprom_93xx46_dev *edev = priv;
+	char *buf = val;
+	int err = 0;
+
+	if (unlikely(off >= edev->size))
+		return 0;
+	if ((off + count) > edev->size)
+		count = edev->size - off;
+	if (unlikely(!count))
+		return count;
+
+	mutex_lock(&edev->lock);
+
+	if (!edev->shadow) {
+		err = eeprom_93xx46_read_chip(edev, off, buf, count);
+	} else {
+		if (!edev->shadow_valid) {
+			err = eeprom_93xx46_read_chip(edev, 0, edev->shadow,
+						      edev->size);
+			edev->shadow_valid = !err;
+		}
+		if (!err)
+			memcpy(buf, edev->shadow + off, count);
+	}
+
 	mutex_unlock(&edev->lock);
 
 	return err;
 }
 
+/* Called with edev->lock held */
 static int eeprom_93xx46_ew(struct eeprom_93xx46_dev *edev, int is_on)
 {
 	struct spi_message m;
@@ -138,19 +367,8 @@ static int eeprom_93xx46_ew(struct eeprom_93xx46_dev *edev, int is_on)
 	int bits, ret;
 	u16 cmd_addr;
 
-	cmd_addr = OP_START << edev->addrlen;
-	if (edev->addrlen == 7) {
-		cmd_addr |= (is_on ? ADDR_EWEN : ADDR_EWDS) << 1;
-		bits = 10;
-	} else {
-		cmd_addr |= (is_on ? ADDR_EWEN : ADDR_EWDS);
-		bits = 9;
-	}
-
-	if (has_quirk_instruction_length(edev)) {
-		cmd_addr <<= 2;
-		bits += 2;
-	}
+	cmd_addr = eeprom_93xx46_special_cmd(edev,
+					     is_on ? ADDR_EWEN : ADDR_EWDS, &bits);
 
 	dev_dbg(&edev->spi->dev, "ew%s cmd 0x%04x, %d bits\n",
 			is_on ? "en" : "ds", cmd_addr, bits);
@@ -163,11 +381,6 @@ static int eeprom_93xx46_ew(struct eeprom_93xx46_dev *edev, int is_on)
 	t.bits_per_word = bits;
 	spi_message_add_tail(&t, &m);
 
-	mutex_lock(&edev->lock);
-
-	if (edev->pdata->prepare)
-		edev->pdata->prepare(edev);
-
 	ret = spi_sync(edev->spi, &m);
 	/* have to wait at least Tcsl ns */
 	ndelay(250);
@@ -175,52 +388,258 @@ static int eeprom_93xx46_ew(struct eeprom_93xx46_dev *edev, int is_on)
 		dev_err(&edev->spi->dev, "erase/write %sable error %d\n",
 			is_on ? "en" : "dis", ret);
 
-	if (edev->pdata->finish)
-		edev->pdata->finish(edev);
-
-	mutex_unlock(&edev->lock);
 	return ret;
 }
 
-static ssize_t
-eeprom_93xx46_write_word(struct eeprom_93xx46_dev *edev,
-			 const char *buf, unsigned off)
+/*
+ * Wait for the end of a program or erase cycle. Once CS is asserted again
+ * after the instruction, the chip drives DO low while busy and high when
+ * ready, so keep clocking in status bits until the last one reads high.
+ * Called with edev->lock held.
+ */
+static int eeprom_93xx46_wait_ready(struct eeprom_93xx46_dev *edev)
 {
-	struct spi_message m;
-	struct spi_transfer t[2];
-	int bits, data_len, ret;
-	u16 cmd_addr;
+	unsigned long timeout = jiffies +
+				msecs_to_jiffies(EEPROM_93XX46_TIMEOUT_MS);
+	struct spi_transfer t = { 0 };
+	bool expired;
+	int ret;
 
-	cmd_addr = OP_WRITE << edev->addrlen;
+	t.rx_buf = &edev->status;
+	t.len = 1;
+	t.bits_per_word = 8;
 
-	if (edev->addrlen == 7) {
-		cmd_addr |= off & 0x7f;
-		bits = 10;
-		data_len = 1;
-	} else {
-		cmd_addr |= (off >> 1) & 0x3f;
-		bits = 9;
-		data_len = 2;
+	do {
+		/* Always give the chip a last chance after the timeout */
+		expired = time_after(jiffies, timeout);
+		ret = spi_sync_transfer(edev->spi, &t, 1);
+		/* have to wait at least Tcsl ns */
+		ndelay(250);
+		if (ret)
+			return ret;
+		if (edev->status & 0x01)
+			return 0;
+		usleep_range(100, 200);
+	} while (!expired);
+
+	dev_err(&edev->spi->dev, "program cycle timeout\n");
+	return -ETIMEDOUT;
+}
+
+static void eeprom_93xx46_batch_complete(void *context);
+static enum hrtimer_restart eeprom_93xx46_poll_timer(struct hrtimer *timer);
+
+static void eeprom_93xx46_init_batch(struct eeprom_93xx46_dev *edev)
+{
+	struct eeprom_93xx46_batch *b = &edev->batch;
+	int bits;
+
+	b->dma.ewen_cmd = eeprom_93xx46_special_cmd(edev, ADDR_EWEN, &bits);
+	b->ewen_xfer.tx_buf = &b->dma.ewen_cmd;
+	b->ewen_xfer.len = 2;
+	b->ewen_xfer.bits_per_word = bits;
+
+	b->write_xfers[0].tx_buf = &b->dma.write_cmd;
+	b->write_xfers[0].len = 2;
+	b->write_xfers[0].bits_per_word = edev->addrlen + 3;
+	b->write_xfers[1].tx_buf = &b->dma.data;
+	b->write_xfers[1].len = eeprom_93xx46_word_len(edev);
+	b->write_xfers[1].bits_per_word = 8;
+
+	b->poll_xfer.rx_buf = &b->dma.status;
+	b->poll_xfer.len = 1;
+	b->poll_xfer.bits_per_word = 8;
+
+	/*
+	 * No explicit Tcsl (250ns) between the messages: each one is only
+	 * submitted from the completion of the previous one, or from the
+	 * poll timer, which already keeps CS deasserted for far longer.
+	 */
+	spi_message_init_with_transfers(&b->ewen_msg, &b->ewen_xfer, 1);
+	spi_message_init_with_transfers(&b->write_msg, b->write_xfers, 2);
+	spi_message_init_with_transfers(&b->poll_msg, &b->poll_xfer, 1);
+	b->ewen_msg.complete = eeprom_93xx46_batch_complete;
+	b->ewen_msg.context = edev;
+	b->write_msg.complete = eeprom_93xx46_batch_complete;
+	b->write_msg.context = edev;
+	b->poll_msg.complete = eeprom_93xx46_batch_complete;
+	b->poll_msg.context = edev;
+
+	hrtimer_init(&b->poll_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	b->poll_timer.function = eeprom_93xx46_poll_timer;
+	init_completion(&b->done);
+}
+
+static void eeprom_93xx46_batch_error(struct eeprom_93xx46_dev *edev, int err)
+{
+	struct eeprom_93xx46_batch *b = &edev->batch;
+
+	dev_err(&edev->spi->dev, "write failed at %d: %d\n",
+		(int)(b->off + b->pos), err);
+	b->err = err;
+	/* The word may or may not have been programmed */
+	edev->shadow_valid = false;
+}
+
+/* The word at pos is programmed */
+static void eeprom_93xx46_batch_word_done(struct eeprom_93xx46_dev *edev)
+{
+	struct eeprom_93xx46_batch *b = &edev->batch;
+	int step = eeprom_93xx46_word_len(edev);
+
+	if (edev->shadow_valid)
+		memcpy(edev->shadow + b->off + b->pos, b->buf + b->pos, step);
+	b->pos += step;
+}
+
+/* End the chain, handing over to eeprom_93xx46_write() */
+static void eeprom_93xx46_batch_end(struct eeprom_93xx46_dev *edev, int err)
+{
+	if (err)
+		eeprom_93xx46_batch_error(edev, err);
+	complete(&edev->batch.done);
+}
+
+static void eeprom_93xx46_batch_submit(struct eeprom_93xx46_dev *edev,
+				       enum eeprom_93xx46_batch_state state,
+				       struct spi_message *m)
+{
+	int ret;
+
+	edev->batch.state = state;
+	ret = spi_async(edev->spi, m);
+	if (ret == -EBUSY) {
+		/* Bus locked: leave this message to eeprom_93xx46_batch_sync() */
+		edev->batch.bus_locked = true;
+		complete(&edev->batch.done);
+	} else if (ret) {
+		eeprom_93xx46_batch_end(edev, ret);
 	}
+}
 
-	dev_dbg(&edev->spi->dev, "write cmd 0x%x\n", cmd_addr);
+/* Program the next word, or end the batch once all are */
+static void eeprom_93xx46_batch_next(struct eeprom_93xx46_dev *edev)
+{
+	struct eeprom_93xx46_batch *b = &edev->batch;
 
-	spi_message_init(&m);
-	memset(t, 0, sizeof(t));
+	if (b->pos >= b->count) {
+		eeprom_93xx46_batch_end(edev, 0);
+		return;
+	}
 
-	t[0].tx_buf = (char *)&cmd_addr;
-	t[0].len = 2;
-	t[0].bits_per_word = bits;
-	spi_message_add_tail(&t[0], &m);
+	b->dma.write_cmd = eeprom_93xx46_cmd(edev, OP_WRITE, b->off + b->pos);
+	memcpy(&b->dma.data, b->buf + b->pos, eeprom_93xx46_word_len(edev));
+	eeprom_93xx46_batch_submit(edev, EE_BATCH_WRITE, &b->write_msg);
+}
+
+static enum hrtimer_restart eeprom_93xx46_poll_timer(struct hrtimer *timer)
+{
+	struct eeprom_93xx46_dev *edev =
+		container_of(timer, struct eeprom_93xx46_dev, batch.poll_timer);
+
+	eeprom_93xx46_batch_submit(edev, EE_BATCH_POLL, &edev->batch.poll_msg);
+	return HRTIMER_NORESTART;
+}
 
-	t[1].tx_buf = buf;
-	t[1].len = data_len;
+/*
+ * Completion of each message of the batch, in atomic context: submit the
+ * next one. The ready/busy status is polled as in eeprom_93xx46_wait_ready(),
+ * from a timer instead of sleeping.
+ */
+static void eeprom_93xx46_batch_complete(void *context)
+{
+	struct eeprom_93xx46_dev *edev = context;
+	struct eeprom_93xx46_batch *b = &edev->batch;
+
+	switch (b->state) {
+	case EE_BATCH_EWEN:
+		if (b->ewen_msg.status)
+			eeprom_93xx46_batch_end(edev, b->ewen_msg.status);
+		else
+			eeprom_93xx46_batch_next(edev);
+		break;
+
+	case EE_BATCH_WRITE:
+		if (b->write_msg.status) {
+			eeprom_93xx46_batch_end(edev, b->write_msg.status);
+			break;
+		}
+		/* have to wait program cycle time Twc */
+		b->timeout = jiffies + msecs_to_jiffies(EEPROM_93XX46_TIMEOUT_MS);
+		b->expired = false;
+		eeprom_93xx46_batch_submit(edev, EE_BATCH_POLL, &b->poll_msg);
+		break;
+
+	case EE_BATCH_POLL:
+		if (b->poll_msg.status) {
+			eeprom_93xx46_batch_end(edev, b->poll_msg.status);
+		} else if (b->dma.status & 0x01) {
+			eeprom_93xx46_batch_word_done(edev);
+			eeprom_93xx46_batch_next(edev);
+		} else if (b->expired) {
+			eeprom_93xx46_batch_end(edev, -ETIMEDOUT);
+		} else {
+			/* Always give the chip a last chance after the timeout */
+			b->expired = time_after(jiffies, b->timeout);
+			hrtimer_start(&b->poll_timer,
+				      ns_to_ktime(100 * NSEC_PER_USEC),
+				      HRTIMER_MODE_REL);
+		}
+		break;
+	}
+}
+
+/*
+ * Finish synchronously a batch whose chain stopped on a locked bus, from
+ * the message it could not submit. Called with edev->lock held.
+ */
+static int eeprom_93xx46_batch_sync(struct eeprom_93xx46_dev *edev)
+{
+	struct eeprom_93xx46_batch *b = &edev->batch;
+	struct spi_transfer t[2] = { { 0 } };
+	int ret = 0;
+
+	switch (b->state) {
+	case EE_BATCH_EWEN:
+		ret = eeprom_93xx46_ew(edev, 1);
+		if (ret)
+			return ret;
+		break;
+	case EE_BATCH_WRITE:
+		/* The word was not sent */
+		break;
+	case EE_BATCH_POLL:
+		/* The word was sent, its program cycle may still be running */
+		ret = eeprom_93xx46_wait_ready(edev);
+		if (!ret)
+			eeprom_93xx46_batch_word_done(edev);
+		break;
+	}
+
+	t[0].tx_buf = &b->dma.write_cmd;
+	t[0].len = 2;
+	t[0].bits_per_word = edev->addrlen + 3;
+	t[1].tx_buf = &b->dma.data;
+	t[1].len = eeprom_93xx46_word_len(edev);
 	t[1].bits_per_word = 8;
-	spi_message_add_tail(&t[1], &m);
 
-	ret = spi_sync(edev->spi, &m);
-	/* have to wait program cycle time Twc ms */
-	mdelay(6);
+	while (!ret && b->pos < b->count) {
+		b->dma.write_cmd = eeprom_93xx46_cmd(edev, OP_WRITE,
+						 b->off + b->pos);
+		memcpy(&b->dma.data, b->buf + b->pos,
+		       eeprom_93xx46_word_len(edev));
+		ret = spi_sync_transfer(edev->spi, t, ARRAY_SIZE(t));
+		/* have to wait at least Tcsl ns */
+		ndelay(250);
+		/* have to wait program cycle time Twc */
+		if (!ret)
+			ret = eeprom_93xx46_wait_ready(edev);
+		if (!ret)
+			eeprom_93xx46_batch_word_done(edev);
+	}
+
+	if (ret)
+		eeprom_93xx46_batch_error(edev, ret);
 	return ret;
 }
 
@@ -228,8 +647,9 @@ static int eeprom_93xx46_write(void *priv, unsigned int off,
 				   void *val, size_t count)
 {
 	struct eeprom_93xx46_dev *edev = priv;
+	struct eeprom_93xx46_batch *b = &edev->batch;
 	char *buf = val;
-	int i, ret, step = 1;
+	int ret, err;
 
 	if (unlikely(off >= edev->size))
 		return -EFBIG;
@@ -239,61 +659,58 @@ static int eeprom_93xx46_write(void *priv, unsigned int off,
 		return count;
 
 	/* only write even number of bytes on 16-bit devices */
-	if (edev->addrlen == 6) {
-		step = 2;
+	if (edev->pdata->flags & EE_ADDR16)
 		count &= ~1;
-	}
-
-	/* erase/write enable */
-	ret = eeprom_93xx46_ew(edev, 1);
-	if (ret)
-		return ret;
 
+	/*
+	 * Hold the lock, and keep writes enabled, for the whole batch: words
+	 * are programmed back to back, each as soon as the previous program
+	 * cycle is over. The batch runs from message completions, leaving the
+	 * bus to other devices in between, while this thread sleeps.
+	 */
 	mutex_lock(&edev->lock);
 
 	if (edev->pdata->prepare)
 		edev->pdata->prepare(edev);
 
-	for (i = 0; i < count; i += step) {
-		ret = eeprom_93xx46_write_word(edev, &buf[i], off + i);
-		if (ret) {
-			dev_err(&edev->spi->dev, "write failed at %d: %d\n",
-				(int)off + i, ret);
-			break;
-		}
-	}
+	b->buf = buf;
+	b->off = off;
+	b->count = count;
+	b->pos = 0;
+	b->err = 0;
+	b->bus_locked = false;
+	reinit_completion(&b->done);
+
+	eeprom_93xx46_batch_submit(edev, EE_BATCH_EWEN, &b->ewen_msg);
+	wait_for_completion(&b->done);
+	ret = b->err;
+	if (b->bus_locked)
+		ret = eeprom_93xx46_batch_sync(edev);
+
+	/*
+	 * erase/write disable, whatever happened, through spi_sync() so that
+	 * a locked bus cannot leave the part write-enabled
+	 */
+	err = eeprom_93xx46_ew(edev, 0);
+	if (!ret)
+		ret = err;
 
 	if (edev->pdata->finish)
 		edev->pdata->finish(edev);
 
 	mutex_unlock(&edev->lock);
-
-	/* erase/write disable */
-	eeprom_93xx46_ew(edev, 0);
 	return ret;
 }
 
+/* Called with edev->lock held and writes enabled */
 static int eeprom_93xx46_eral(struct eeprom_93xx46_dev *edev)
 {
-	struct eeprom_93xx46_platform_data *pd = edev->pdata;
 	struct spi_message m;
 	struct spi_transfer t;
 	int bits, ret;
 	u16 cmd_addr;
 
-	cmd_addr = OP_START << edev->addrlen;
-	if (edev->addrlen == 7) {
-		cmd_addr |= ADDR_ERAL << 1;
-		bits = 10;
-	} else {
-		cmd_addr |= ADDR_ERAL;
-		bits = 9;
-	}
-
-	if (has_quirk_instruction_length(edev)) {
-		cmd_addr <<= 2;
-		bits += 2;
-	}
+	cmd_addr = eeprom_93xx46_special_cmd(edev, ADDR_ERAL, &bits);
 
 	dev_dbg(&edev->spi->dev, "eral cmd 0x%04x, %d bits\n", cmd_addr, bits);
 
@@ -305,22 +722,16 @@ static int eeprom_93xx46_eral(struct eeprom_93xx46_dev *edev)
 	t.bits_per_word = bits;
 	spi_message_add_tail(&t, &m);
 
-	mutex_lock(&edev->lock);
-
-	if (edev->pdata->prepare)
-		edev->pdata->prepare(edev);
-
 	ret = spi_sync(edev->spi, &m);
-	if (ret)
+	/* have to wait at least Tcsl ns */
+	ndelay(250);
+	if (ret) {
 		dev_err(&edev->spi->dev, "erase error %d\n", ret);
-	/* have to wait erase cycle time Tec ms */
-	mdelay(6);
-
-	if (pd->finish)
-		pd->finish(edev);
+		return ret;
+	}
 
-	mutex_unlock(&edev->lock);
-	return ret;
+	/* have to wait erase cycle time Tec */
+	return eeprom_93xx46_wait_ready(edev);
 }
 
 static ssize_t eeprom_93xx46_store_erase(struct device *dev,
@@ -328,17 +739,31 @@ static ssize_t eeprom_93xx46_store_erase(struct device *dev,
 					 const char *buf, size_t count)
 {
 	struct eeprom_93xx46_dev *edev = dev_get_drvdata(dev);
-	int erase = 0, ret;
+	int erase = 0, ret, err;
 
 	sscanf(buf, "%d", &erase);
 	if (erase) {
+		mutex_lock(&edev->lock);
+		if (edev->pdata->prepare)
+			edev->pdata->prepare(edev);
+
 		ret = eeprom_93xx46_ew(edev, 1);
-		if (ret)
-			return ret;
-		ret = eeprom_93xx46_eral(edev);
-		if (ret)
-			return ret;
-		ret = eeprom_93xx46_ew(edev, 0);
+		if (!ret)
+			ret = eeprom_93xx46_eral(edev);
+		if (edev->shadow) {
+			/* Erased cells read as all ones */
+			if (!ret)
+				memset(edev->shadow, 0xff, edev->size);
+			edev->shadow_valid = !ret;
+		}
+		/* erase/write disable, whatever happened */
+		err = eeprom_93xx46_ew(edev, 0);
+		if (!ret)
+			ret = err;
+
+		if (edev->pdata->finish)
+			edev->pdata->finish(edev);
+		mutex_unlock(&edev->lock);
 		if (ret)
 			return ret;
 	}
@@ -363,6 +788,11 @@ static void select_deassert(void *context)
 static const struct of_device_id eeprom_93xx46_of_table[] = {
 	{ .compatible = "eeprom-93xx46", },
 	{ .compatible = "atmel,at93c46d", .data = &atmel_at93c46d_data, },
+	{ .compatible = "microchip,93lc46b", .data = &microchip_93lc46b_data, },
+	{ .compatible = "microchip,93lc56b", .data = &microchip_93lc56b_data, },
+	{ .compatible = "microchip,93lc66b", .data = &microchip_93lc66b_data, },
+	{ .compatible = "microchip,93lc76b", .data = &microchip_93lc76b_data, },
+	{ .compatible = "microchip,93lc86b", .data = &microchip_93lc86b_data, },
 	{}
 };
 MODULE_DEVICE_TABLE(of, eeprom_93xx46_of_table);
@@ -411,8 +841,13 @@ static int eeprom_93xx46_probe_dt(struct spi_device *spi)
 		const struct eeprom_93xx46_devtype_data *data = of_id->data;
 
 		pd->quirks = data->quirks;
+		pd->size = data->size;
 	}
 
+	/* The size property, if any, overrides the one of the compatible */
+	if (!of_property_read_u32(np, "size", &tmp))
+		pd->size = tmp;
+
 	spi->dev.platform_data = pd;
 
 	return 0;
@@ -440,10 +875,23 @@ static int eeprom_93xx46_probe(struct spi_device *spi)
 	if (!edev)
 		return -ENOMEM;
 
+	edev->size = pd->size ? pd->size : EEPROM_93XX46_MIN_SIZE;
+	if (!is_power_of_2(edev->size) ||
+	    edev->size < EEPROM_93XX46_MIN_SIZE ||
+	    edev->size > EEPROM_93XX46_MAX_SIZE) {
+		dev_err(&spi->dev, "invalid size (%d)\n", edev->size);
+		return -EINVAL;
+	}
+
+	/*
+	 * The 93xx56 and 93xx76 take as many address bits as the next size
+	 * up, the extra one being don't care: 7, 9 or 11 bits in 8-bit
+	 * organization, one less in 16-bit organization.
+	 */
 	if (pd->flags & EE_ADDR8)
-		edev->addrlen = 7;
+		edev->addrlen = ilog2(edev->size) | 1;
 	else if (pd->flags & EE_ADDR16)
-		edev->addrlen = 6;
+		edev->addrlen = (ilog2(edev->size) | 1) - 1;
 	else {
 		dev_err(&spi->dev, "unspecified address type\n");
 		return -EINVAL;
@@ -454,7 +902,20 @@ static int eeprom_93xx46_probe(struct spi_device *spi)
 	edev->spi = spi;
 	edev->pdata = pd;
 
-	edev->size = 128;
+	if (has_quirk_single_word_read(edev)) {
+		err = eeprom_93xx46_init_read_chain(edev);
+		if (err)
+			return err;
+	}
+
+	eeprom_93xx46_init_batch(edev);
+
+	if (shadow) {
+		edev->shadow = devm_kmalloc(&spi->dev, edev->size, GFP_KERNEL);
+		if (!edev->shadow)
+			return -ENOMEM;
+	}
+
 	edev->nvmem_config.type = NVMEM_TYPE_EEPROM;
 	edev->nvmem_config.name = dev_name(&spi->dev);
 	edev->nvmem_config.dev = &spi->dev;
@@ -474,7 +935,7 @@ static int eeprom_93xx46_probe(struct spi_device *spi)
 	if (IS_ERR(edev->nvmem))
 		return PTR_ERR(edev->nvmem);
 
-	dev_info(&spi->dev, "%d-bit eeprom %s\n",
+	dev_info(&spi->dev, "%d bytes %d-bit eeprom %s\n", edev->size,
 		(pd->flags & EE_ADDR8) ? 8 : 16,
 		(pd->flags & EE_READONLY) ? "(readonly)" : "");
 